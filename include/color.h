@@ -0,0 +1,36 @@
+#ifndef COLOR_H
+#define COLOR_H
+
+#include <stdint.h>
+
+#include "global_defines.h"
+
+#define MAX_BRIGHTNESS 0.05
+#define COLOR_CHANNELS 3  /* Same order as color_frame: G, R, B */
+#define COLOR_LEVELS 256  /* Brightness levels, one per serial input byte */
+
+/* Output value for each input value of each channel */
+struct color_lut {
+    uint8_t ch[COLOR_CHANNELS][256];
+};
+
+/* Lookup tables for every brightness level, built once up front so a level
+   change is published by swapping a pointer and tables are never freed */
+struct color_table {
+    struct color_lut luts[COLOR_LEVELS];
+    const struct color_lut *current;
+};
+
+void color_table_init(
+    struct color_table *table,
+    double max_brightness,
+    double gamma,
+    const double balance[COLOR_CHANNELS]
+);
+void color_table_init_scaled(struct color_table *table, double max_scale);
+void color_table_set_level(struct color_table *table, uint8_t level);
+const struct color_lut *color_table_get(struct color_table *table);
+uint8_t color_table_level(struct color_table *table, const struct color_lut *lut);
+uint8_t color_lut_is_identity(const struct color_lut *lut);
+
+#endif
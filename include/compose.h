@@ -0,0 +1,114 @@
+#ifndef COMPOSE_H
+#define COMPOSE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "global_defines.h"
+#include "gif.h"
+#include "packet.h"
+#include "color.h"
+
+/* Colors for the full dance floor, channels in GRB order */
+struct color_frame {
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS];
+    uint8_t adjusted[LED_ROWS][LED_COLS][LED_CHANNELS];  /* Colors with adjusted brightness */
+
+    const struct color_lut *lut;  /* Table adjusted was derived with, null if it holds compositor output */
+    struct rect dirty;  /* Pixels of adjusted changed since the packetizer last took it */
+};
+
+#define COMPOSE_LAYERS 4
+#define COMPOSE_STEP_NS 10000000ULL  /* Redraw interval while a transition runs */
+
+enum blend_mode {
+    BLEND_NORMAL,
+    BLEND_ADD,
+    BLEND_MULTIPLY,
+    BLEND_SCREEN
+};
+
+/* How the outgoing GIF gives way to a newly loaded one */
+enum transition_type {
+    TRANSITION_CUT,
+    TRANSITION_FADE,
+    TRANSITION_WIPE  /* Left to right */
+};
+
+/* Layer over the GIF, a solid color or another GIF */
+struct layer {
+    uint8_t color[LED_CHANNELS];  /* GRB, for solid color layers */
+    uint8_t opacity;  /* 0 hides the layer */
+    uint8_t mode;  /* enum blend_mode */
+};
+
+/* GIF drawn as a layer, animated on its own clock. Covers the whole floor,
+   transparent pixels show its background color, so overlays on black are
+   best drawn with add or screen */
+struct layer_source {
+    struct gif *gif;  /* Null for a solid color layer */
+    uint8_t *canvas;  /* ct_indices of the current frame, expanded from the frame store */
+    size_t frame_index;
+    uint64_t next;  /* Unit: ns, when the next frame is due, 0 before the first */
+    struct color_frame frame;  /* The GIF composited up to frame_index */
+};
+
+/* Stack drawn over color_frame->colors: the outgoing frame while a
+   transition runs, then each layer bottom up. Render thread only */
+struct compositor {
+    struct layer layers[COMPOSE_LAYERS];
+    uint8_t fills[COMPOSE_LAYERS][LED_ROWS][LED_COLS][LED_CHANNELS];  /* Each layer's color, for the blend kernels */
+    struct layer_source sources[COMPOSE_LAYERS];
+
+    uint8_t transition;  /* enum transition_type */
+    uint64_t transition_ns;
+    uint64_t transition_start;  /* Unit: ns */
+    uint64_t transition_end;
+    uint8_t from[LED_ROWS][LED_COLS][LED_CHANNELS];  /* Last frame of the outgoing GIF */
+
+    uint64_t next_step;  /* When the stack needs drawing again, UINT64_MAX if only on frame switches */
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS];  /* Composed output, before brightness */
+};
+
+int compose_parse_blend(uint8_t *mode, const char *name);
+int compose_parse_transition(uint8_t *type, uint64_t *duration, const char *arg);
+void compose_blend(uint8_t *dst, const uint8_t *src, size_t bytes, uint8_t opacity, uint8_t mode);
+
+void compositor_init(struct compositor *compositor, uint8_t transition, uint64_t transition_ns);
+void compositor_set_layer(
+    struct compositor *compositor,
+    uint8_t index,
+    const struct layer *layer,
+    struct gif *gif
+);
+void compositor_free(struct compositor *compositor);
+void compositor_begin_transition(
+    struct compositor *compositor,
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS],
+    uint64_t now
+);
+uint8_t compositor_is_active(struct compositor *compositor, uint64_t now);
+void compose_layers(
+    struct compositor *compositor,
+    struct color_frame *color_frame,
+    uint64_t now,
+    const struct color_lut *lut
+);
+
+void compose_frame(
+    struct color_frame *color_frame,
+    struct gif *gif,
+    struct frame *frame,
+    const uint8_t *ct_indices,
+    uint16_t stride,
+    const struct color_lut *lut
+);
+void compose_first_frame(
+    struct color_frame *color_frame,
+    struct gif *gif,
+    const uint8_t *ct_indices,
+    uint16_t stride,
+    const struct color_lut *lut
+);
+
+#endif
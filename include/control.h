@@ -0,0 +1,91 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "gif.h"
+#include "color.h"
+#include "compose.h"
+
+#define SER_NAME "/dev/ttyACM0"
+#define CONTROL_SOCKET_PATH "/tmp/ddf.sock"
+#define CONTROL_QUEUE_LENGTH 16  /* Power of two */
+#define CONTROL_COMMAND_BYTES 4096  /* Longest command datagram, including a GIF path */
+#define CONTROL_EPOLL_EVENTS 4
+#define CONTROL_LOAD_TARGETS (1 + COMPOSE_LAYERS)  /* The played GIF, then each layer */
+
+enum command_type {
+    COMMAND_LOAD,  /* Switch to gif */
+    COMMAND_PAUSE,
+    COMMAND_RESUME,
+    COMMAND_NEXT,  /* Show the next frame now, also while paused */
+    COMMAND_LAYER,  /* Replace a compositor layer */
+    COMMAND_QUIT
+};
+
+struct command {
+    enum command_type type;
+    struct gif *gif;  /* Loaded GIF for COMMAND_LOAD or a GIF layer, owned by the receiver */
+    uint8_t layer_index;  /* For COMMAND_LAYER */
+    struct layer layer;
+};
+
+/* Single producer, single consumer ring of commands for the render thread */
+struct command_queue {
+    struct command commands[CONTROL_QUEUE_LENGTH];
+
+    /* Unit: commands, counting up from start */
+    size_t head;  /* Written by the consumer */
+    size_t tail;  /* Written by the producer */
+};
+
+/* Control thread waiting on serial brightness input, the command socket
+   and termination signals. Brightness is applied directly, everything else
+   is queued for the render thread. GIFs are loaded on a loader thread, and
+   queued by the control thread once they are done */
+struct control {
+    struct color_table *colors;
+    uint8_t lazy_decode;  /* For loaded GIFs */
+    struct scale_options scaling;
+    const char *socket_path;
+
+    int epoll_fd;
+    int ser_fd;  /* -1 without serial input */
+    int sock_fd;
+    int sig_fd;
+    int wake_fd;  /* eventfd, signalled when commands are queued */
+    int loaded_fd;  /* eventfd, signalled when the loader has a GIF ready */
+
+    struct command_queue queue;
+    uint8_t stop;  /* Set once a termination signal arrives */
+
+    /* Handed between the control and loader threads, per load target */
+    pthread_mutex_t lock;
+    pthread_cond_t load_wake;
+    char load_paths[CONTROL_LOAD_TARGETS][CONTROL_COMMAND_BYTES];  /* Latest GIF asked for */
+    struct layer load_layers[CONTROL_LOAD_TARGETS];  /* How a GIF layer is drawn once loaded */
+    uint32_t load_serials[CONTROL_LOAD_TARGETS];  /* Bumped by each command for the target, older loads are dropped */
+    uint8_t is_load_wanted[CONTROL_LOAD_TARGETS];
+    uint8_t load_stop;
+    struct gif *loaded[CONTROL_LOAD_TARGETS];  /* Loaded GIFs not queued yet */
+    struct layer loaded_layers[CONTROL_LOAD_TARGETS];
+
+    pthread_t thread;
+    pthread_t load_thread;
+};
+
+int control_start(
+    struct control *control,
+    struct color_table *colors,
+    const char *socket_path,
+    uint8_t lazy_decode,
+    const struct scale_options *scaling
+);
+uint8_t control_next(struct control *control, struct command *command);
+void control_wait(struct control *control, uint64_t deadline);
+uint8_t control_is_stopped(struct control *control);
+void control_quit(struct control *control);
+void control_stop(struct control *control);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef FILE_MAP_H
+#define FILE_MAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Read-only view of a whole file, memory mapped where possible */
+struct file_map {
+    const uint8_t *data;
+    size_t size;
+    uint8_t is_mapped;  /* 0 if data was read into a heap buffer instead */
+};
+
+int file_map_open(struct file_map *map, const char *filename);
+void file_map_close(struct file_map *map);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef FRAME_STORE_H
+#define FRAME_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "gif.h"
+
+#define FRAME_DELTA_MAX_GAP 4  /* Unchanged pixels sent as literals rather than starting a new span */
+
+/* Compact encodings of a frame's ct_indices over its rect, chosen per frame by size:
+   FRAME_RAW - Copy of ct_indices
+   FRAME_PACKED4 - Two indices per byte, low nibble first, for indices below 16
+   FRAME_RLE - (run length 1-255, index) byte pairs
+   FRAME_DELTA - Spans changed from the previous frame's indices, each a
+                 16-bit LE skip, a 16-bit LE count and count indices. Only
+                 used when both frames have the same rect */
+enum frame_encoding {
+    FRAME_RAW,
+    FRAME_PACKED4,
+    FRAME_RLE,
+    FRAME_DELTA
+};
+
+void frame_store_encode(struct gif *gif);
+uint8_t *frame_store_expand(struct gif *gif, size_t index, uint8_t *canvas);
+struct gif *frame_store_load(const char *filename, uint8_t lazy_decode, const struct scale_options *scaling);
+
+#endif
@@ -4,16 +4,17 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "global_defines.h"
 #include "util.h"
 #include "dyn_arr.h"
+#include "file_map.h"
+#include "color.h"
+#include "scale.h"
 
-/* A row in the code table */
-struct code_table_entry {
-    uint8_t *indices;
-    uint16_t length;
-};
+#define GIF_DECODE_THREADS_MAX 16
 
 /* Graphic control extension */
 struct gce {
@@ -32,12 +33,37 @@ struct id {
     uint8_t is_interlaced;
 };
 
-struct frame {
-    /* Will either hold LCT or GCT data, depending on what is given */
-    uint8_t ct[256][3];
+/* Color table, stored once per gif however many frames use it */
+struct palette {
+    uint8_t ct[256][3];  /* As in the file, zeroed past max_ct_color */
     uint8_t max_ct_color;
+    uint64_t hash;
+
+    uint8_t grb[256][COLOR_CHANNELS];  /* ct in color_frame channel order */
+
+    /* grb through lut, redone when a frame is composited with another
+       table. Render thread only */
+    const struct color_lut *lut;
+    uint8_t adjusted[256][COLOR_CHANNELS];
+};
+
+struct frame {
+    /* Index into gif->palettes of the LCT, or the GCT if there is none */
+    uint32_t palette;
+
+    /* Pixels this frame can change when composited over the one before:
+       the image rectangle if everything outside it is transparent, shrunk
+       to its non-transparent pixels once decoded, otherwise the canvas */
+    struct rect rect;
 
-    uint8_t *ct_indices;  /* Size: canvas_w * canvas_h */
+    uint8_t *ct_indices;  /* Size: rect.w * rect.h, null if decoded on demand or encoded */
+    size_t source;  /* Index of the frame owning ct_indices/data, this one's unless a duplicate */
+
+    /* ct_indices in the enum frame_encoding given by encoding, once
+       frame_store_encode has run */
+    uint8_t encoding;
+    uint8_t *data;
+    uint32_t data_bytes;
 
     uint16_t delay;
 
@@ -47,39 +73,61 @@ struct frame {
     uint8_t disposal;
     uint8_t has_transparency;
     uint8_t transparent_index;
+
+    /* Compressed image data as data sub-blocks inside gif->input,
+       only kept when decoding on demand */
+    struct id id;
+    uint8_t min_code_size;
+    const uint8_t *codes;
+    uint32_t code_bytes;
 };
 
 struct gif {
+    /* Canvas frames are decoded onto, the floor's size when scaled */
     uint16_t w;
     uint16_t h;
 
-    uint8_t gct[256][3];
-    uint8_t max_gct_color;
+    /* Logical screen as given in the file */
+    uint16_t screen_w;
+    uint16_t screen_h;
+
+    /* How a logical screen of another size than the floor is fitted to it,
+       scale is the resulting plan or null if the sizes match */
+    struct scale_options scaling;
+    struct scale *scale;
+
+    uint32_t gct;  /* Index into palettes */
     uint8_t has_gct;
 
     uint8_t bg_index;
 
+    /* Keep frames compressed and decode them with gif_decode_frame */
+    uint8_t lazy_decode;
+
+    /* File contents, kept open while frames are decoded on demand */
+    struct file_map input;
+
+    /* Threads decoding frames on load, 0 for one per online CPU */
+    uint8_t decode_threads;
+
     struct dyn_arr frames;
+    struct dyn_arr palettes;  /* Distinct color tables, of struct palette */
 };
 
 void gif_init(struct gif *gif);
-void gif_load_ct(struct gif *gif, uint8_t max_ct_color, struct frame *frame, FILE *file);
-void gif_init_code_table(struct dyn_arr *code_table, struct frame *frame);
-void gif_free_code_table(struct dyn_arr *code_table);
-uint8_t gif_increment_decode(
-    struct gif *gif,
-    uint16_t *frame_row,
-    uint16_t *frame_col,
-    uint32_t *index_counter
-); 
+uint32_t gif_load_ct(struct gif *gif, uint8_t max_ct_color, const uint8_t *ct);
+struct palette *gif_palette(struct gif *gif, struct frame *frame);
+const uint8_t *gif_skip_sub_blocks(const uint8_t *pos, const uint8_t *end);
 void gif_decode(
     struct gif *gif,
     struct id *id,
     struct frame *frame,
-    uint8_t *frame_codes, uint32_t code_bytes,
-    uint8_t min_code_size
+    const uint8_t *frame_codes, uint32_t code_bytes,
+    uint8_t min_code_size,
+    uint8_t *ct_indices
 );
-int gif_load_frame(struct gif *gif, struct gce *gce, uint8_t *buffer, FILE *file);
+void gif_decode_frame(struct gif *gif, struct frame *frame, uint8_t *ct_indices);
+int gif_load_frame(struct gif *gif, struct gce *gce, const uint8_t **pos, const uint8_t *end);
 int gif_load(struct gif *gif, const char *filename);
 void gif_free(struct gif *gif);
 
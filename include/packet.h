@@ -0,0 +1,86 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "global_defines.h"
+#include "util.h"
+#include "color.h"
+
+#define CHUNKS 27
+#define LED_CHANNELS 3
+#define LED_BITS 24  /* LED_CHANNELS*8 */
+#define CHUNK_ROWS 8
+#define CHUNK_COLS 55
+#define LED_INDEX_BYTES 2
+#define DATA_BYTES 81  /* CHUNKS*LED_CHANNELS */
+#define CHUNK_LEDS 440  /* CHUNK_ROWS*CHUNK_COLS */
+#define HEADER_BYTES 14  /* sizeof(struct ether_header) = 6+6+2 */
+#define FRAME_BYTES 97  /* HEADER_BYTES+LED_INDEX_BYTES+DATA_BYTES */
+
+/* Implementations of packet_fill, PACKET_KERNEL_AUTO picks the fastest available */
+enum packet_kernel {
+    PACKET_KERNEL_AUTO,
+    PACKET_KERNEL_REFERENCE,
+    PACKET_KERNEL_SCALAR,
+    PACKET_KERNEL_SSE2,
+    PACKET_KERNEL_AVX2
+};
+
+extern enum packet_kernel packet_kernel;
+
+/* Ready to send Ethernet frames for one full refresh of the floor */
+struct packet_set {
+    uint8_t packets[CHUNK_LEDS][FRAME_BYTES];
+};
+
+/* Packet sets for each GIF frame, rendered on first display */
+struct packet_cache {
+    struct packet_set **sets;  /* Null until rendered */
+    uint8_t *is_valid;  /* Cleared when the color table changes */
+    size_t length;
+
+    const struct color_lut *lut;  /* Color table all sets were rendered with */
+    uint8_t header[HEADER_BYTES];
+};
+
+/* Last payload sent for each LED index, so a refresh can send only the
+   packets that changed */
+struct packet_delta {
+    uint8_t sent[CHUNK_LEDS][DATA_BYTES];
+    struct packet_set changed;  /* Packets to send, compacted to the front */
+};
+
+void color_frame_to_eth(
+    uint8_t *frame_buffer,
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS],
+    uint16_t led_index
+);
+uint16_t eth_to_color_frame(
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS],
+    const uint8_t *frame_buffer
+);
+void packet_fill(
+    uint8_t *frame_buffer,
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS],
+    uint16_t led_index
+);
+void packet_set_init(struct packet_set *set, const uint8_t *header);
+void packet_set_render(struct packet_set *set, uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS]);
+void packet_set_render_stale(
+    struct packet_set *set,
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS],
+    uint8_t stale[CHUNK_LEDS]
+);
+void packet_mark_rect(uint8_t stale[CHUNK_LEDS], const struct rect *rect);
+
+void packet_cache_init(struct packet_cache *cache, size_t length, const uint8_t *header);
+struct packet_set *packet_cache_get(struct packet_cache *cache, size_t index, const struct color_lut *lut);
+struct packet_set *packet_cache_add(struct packet_cache *cache, size_t index);
+void packet_cache_free(struct packet_cache *cache);
+
+void packet_delta_init(struct packet_delta *delta, const uint8_t *header);
+uint16_t packet_delta_diff(struct packet_delta *delta, struct packet_set *set, uint8_t is_full);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "gif.h"
+#include "dyn_arr.h"
+
+#define PLAYLIST_LOOPS 1  /* Default times through each item */
+
+/* GIF to play, given on the command line as path[@seconds|@Nx] */
+struct playlist_item {
+    const char *filename;
+    uint64_t duration;  /* Unit: ns, 0 to play for loops instead */
+    uint32_t loops;
+};
+
+/* Items played in order, and repeated. The next item is loaded on a
+   background thread while the current one plays, and taken by the render
+   thread at a frame boundary once the current item is done */
+struct playlist {
+    struct dyn_arr items;
+    uint8_t lazy_decode;  /* For loaded GIFs */
+    struct scale_options scaling;
+
+    /* Render thread only */
+    size_t current;
+    uint64_t started;  /* Unit: ns, when current item started */
+    uint32_t extended;  /* Extra turns of current item, since no other loaded */
+
+    /* Handed between the render and loader threads */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    size_t next;  /* Item to load, or that ready holds */
+    uint8_t is_wanted;  /* Loader has an item to load */
+    uint8_t is_failed;  /* No item loaded, retried when the current is due again */
+    uint8_t stop;
+    struct gif *ready;  /* Loaded next item, taken with playlist_take */
+
+    pthread_t thread;
+};
+
+void playlist_init(struct playlist *playlist, uint8_t lazy_decode, const struct scale_options *scaling);
+int playlist_add(struct playlist *playlist, char *arg);
+struct playlist_item *playlist_current(struct playlist *playlist);
+int playlist_start(struct playlist *playlist, uint64_t now);
+uint8_t playlist_is_due(struct playlist *playlist, uint64_t now, uint32_t loops);
+struct gif *playlist_take(struct playlist *playlist, uint64_t now);
+void playlist_stop(struct playlist *playlist);
+
+#endif
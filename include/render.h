@@ -0,0 +1,43 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdint.h>
+
+#include "packet.h"
+
+#define RENDER_SLOTS 3
+#define RENDER_FRESH 0x4  /* Set in middle when it holds a refresh not yet taken */
+#define RENDER_POLL_NS 50000
+
+/* Triple buffer handing rendered refreshes from the render thread to the
+   transmit thread without locks. The render thread owns back, the transmit
+   thread owns front, and the two swap with middle atomically */
+struct render_buffer {
+    struct packet_set sets[RENDER_SLOTS];
+
+    /* Set to send for each slot, either the slot's own storage or a packet
+       cache entry. Written only by the owner of the slot */
+    struct packet_set *packets[RENDER_SLOTS];
+
+    /* Packets in each slot's storage that are out of date with the colors
+       rendered from. Render thread only */
+    uint8_t stale[RENDER_SLOTS][CHUNK_LEDS];
+
+    uint8_t back;
+    uint8_t middle;
+    uint8_t front;
+};
+
+void render_buffer_init(struct render_buffer *buf, const uint8_t *header);
+struct packet_set *render_buffer_back(struct render_buffer *buf);
+void render_buffer_invalidate(struct render_buffer *buf, const struct rect *rect);
+struct packet_set *render_buffer_render(
+    struct render_buffer *buf,
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS]
+);
+void render_buffer_publish(struct render_buffer *buf, struct packet_set *packets);
+uint8_t render_buffer_is_published(struct render_buffer *buf, const struct packet_set *packets);
+uint8_t render_buffer_is_pending(struct render_buffer *buf);
+struct packet_set *render_buffer_front(struct render_buffer *buf, uint8_t *is_new);
+
+#endif
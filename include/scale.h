@@ -0,0 +1,71 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <stdint.h>
+
+#include "global_defines.h"
+
+#define SCALE_WEIGHT_BITS 12
+#define SCALE_WEIGHT_ONE 4096  /* 1 << SCALE_WEIGHT_BITS */
+
+/* How a GIF of another size than the floor is fitted to it */
+enum scale_mode {
+    SCALE_NONE,  /* Refuse to load it */
+    SCALE_FIT,  /* Whole image, centered, margins take the background */
+    SCALE_FILL,  /* Covers the floor, centered, edges cut off */
+    SCALE_CROP,  /* Unscaled, centered, cut off or surrounded by background */
+    SCALE_STRETCH  /* Each axis scaled on its own */
+};
+
+enum scale_filter {
+    SCALE_NEAREST,  /* Keeps the GIF's own color indices */
+    SCALE_BILINEAR,
+    SCALE_AREA  /* Average of the source pixels covered, best for shrinking */
+};
+
+struct scale_options {
+    uint8_t mode;  /* enum scale_mode */
+    uint8_t filter;  /* enum scale_filter */
+};
+
+/* Source pixels and weights making up each output pixel along one axis.
+   Every output pixel reads the same number of consecutive source pixels,
+   those it doesn't need weigh 0 */
+struct scale_axis {
+    uint16_t offset;  /* First output pixel covered by the image */
+    uint16_t length;  /* Output pixels covered by the image */
+    uint16_t taps;
+    uint32_t *first;  /* Size: length, first source pixel read */
+    uint16_t *weight;  /* Size: length * taps, each pixel's sum to SCALE_WEIGHT_ONE */
+};
+
+/* Resampling plan from a GIF's logical screen to the floor, built once
+   per GIF and shared by every thread decoding its frames */
+struct scale {
+    uint16_t src_w;
+    uint16_t src_h;
+    uint16_t dst_w;
+    uint16_t dst_h;
+    uint8_t filter;  /* enum scale_filter */
+    struct scale_axis x;
+    struct scale_axis y;
+};
+
+int scale_parse(struct scale_options *options, const char *arg);
+int scale_init(
+    struct scale *scale,
+    uint16_t src_w, uint16_t src_h,
+    uint16_t dst_w, uint16_t dst_h,
+    const struct scale_options *options
+);
+void scale_free(struct scale *scale);
+void scale_frame(
+    const struct scale *scale,
+    const uint8_t *ct, uint8_t max_ct_color,
+    uint8_t has_transparency, uint8_t transparent_index,
+    uint8_t fill_index,
+    const uint8_t *src,
+    uint8_t *dst
+);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef SHOW_H
+#define SHOW_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "global_defines.h"
+#include "packet.h"
+#include "file_map.h"
+
+#define SHOW_MAGIC "DDFSHOW"  /* 8 bytes with the terminator */
+#define SHOW_VERSION 1
+#define SHOW_ALIGN 64  /* Payload table alignment, unit: bytes */
+
+/* Compiled show file, written by ddfc. Native (little-endian) layout:
+   struct show_header
+   struct show_frame[frame_count]  at frames_offset
+   payloads[payload_count][CHUNK_LEDS][DATA_BYTES]  at payloads_offset
+   Brightness, gamma and white balance are baked into the payloads */
+struct show_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t frame_count;
+    uint32_t payload_count;  /* Frames with identical packets share a payload */
+    uint16_t leds;  /* CHUNK_LEDS */
+    uint16_t payload_bytes;  /* DATA_BYTES */
+    uint64_t frames_offset;
+    uint64_t payloads_offset;
+
+    /* Color settings the show was compiled with, informational */
+    double brightness;
+    double gamma;
+};
+
+struct show_frame {
+    uint32_t payload;  /* Index into the payload table */
+    uint16_t delay;  /* Unit: 10 ms, as in GIFs */
+    uint16_t reserved;
+};
+
+/* Show file mapped for playback */
+struct show {
+    struct file_map input;
+    const struct show_header *header;
+    const struct show_frame *frames;
+    const uint8_t *payloads;
+};
+
+int show_open(struct show *show, const char *filename);
+const uint8_t *show_payload(struct show *show, size_t frame_index, uint16_t led_index);
+void show_fill(struct show *show, size_t frame_index, struct packet_set *set);
+void show_close(struct show *show);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define STATS_PATH "/dev/shm/ddf-stats"
+#define STATS_MAGIC "DDFSTAT"  /* 8 bytes with the terminator */
+#define STATS_VERSION 1
+
+/* Log-linear buckets: values below STATS_SUB_BUCKETS get a bucket each,
+   every power of two above is split into STATS_SUB_BUCKETS buckets */
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS 16  /* 1 << STATS_SUB_BITS */
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+enum stats_stage {
+    STATS_COMPOSE,  /* Expanding or decoding and compositing up to the frame due */
+    STATS_PACKETIZE,
+    STATS_SEND,  /* One tx_send batch */
+    STATS_PACE,  /* Waiting for refresh and batch deadlines */
+    STATS_REFRESH,  /* All batches of one refresh, pacing included */
+    STATS_STAGES
+};
+
+enum stats_counter {
+    STATS_SEND_ERRORS,
+    STATS_SEND_AGAIN,  /* Sends that failed for lack of buffer space (EAGAIN, ENOBUFS) */
+    STATS_FRAMES_MISSED,  /* Frames skipped for being past their deadline */
+    STATS_COUNTERS
+};
+
+/* Latency histogram, unit: ns. Updated atomically, so readers may see a
+   count that is slightly ahead of the buckets */
+struct stats_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+/* Shared memory segment at STATS_PATH, read by ddfstat */
+struct stats {
+    char magic[8];
+    uint32_t version;
+    int32_t pid;
+    uint64_t started;  /* CLOCK_MONOTONIC, unit: ns */
+
+    struct stats_histogram histograms[STATS_STAGES];
+    uint64_t counters[STATS_COUNTERS];
+};
+
+/* Segment recorded into, process local until stats_open succeeds */
+extern struct stats *stats;
+extern const char *stats_stage_names[STATS_STAGES];
+extern const char *stats_counter_names[STATS_COUNTERS];
+
+int stats_open(const char *path);
+void stats_close(void);
+void stats_record(enum stats_stage stage, uint64_t ns);
+void stats_count(enum stats_counter counter, uint64_t n);
+
+uint16_t stats_bucket(uint64_t ns);
+uint64_t stats_bucket_max(uint16_t bucket);
+uint64_t stats_percentile(const struct stats_histogram *histogram, double fraction);
+
+#endif
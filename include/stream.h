@@ -0,0 +1,33 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "gif.h"
+
+#define STREAM_SLOTS 4  /* Frames decoded ahead, including the one on display */
+
+/* Ring of decoded frames, filled in order by a background decoder thread */
+struct gif_stream {
+    struct gif *gif;
+
+    uint8_t *slots[STREAM_SLOTS];  /* ct_indices of decoded frames */
+
+    /* Unit: frames, counting up from stream start */
+    size_t decoded;
+    size_t consumed;
+    size_t released;
+
+    uint8_t stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+};
+
+int gif_stream_start(struct gif_stream *stream, struct gif *gif);
+uint8_t *gif_stream_next(struct gif_stream *stream, size_t *frame_index);
+void gif_stream_stop(struct gif_stream *stream);
+
+#endif
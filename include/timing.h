@@ -0,0 +1,65 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define PACER_CALIBRATE_SLEEPS 32
+#define PACER_CALIBRATE_SLEEP_NS 50000
+
+#define FRAME_DELAY_NS 10000000ULL  /* GIF delays are in units of 10 ms */
+#define FRAME_CLOCK_RESYNC_NS 1000000000ULL
+
+/* Running statistics over a series of intervals, unit: ns */
+struct interval_stats {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+    double sum_sq;
+};
+
+/* Schedules packet batches against absolute CLOCK_MONOTONIC deadlines */
+struct pacer {
+    /* Unit: ns */
+    uint64_t gap;  /* Target time between batch starts */
+    uint64_t refresh;  /* Target time between refresh starts, 0 if unpaced */
+    uint64_t spin;  /* Waits shorter than this are spun, longer ones sleep until spin before the deadline */
+
+    uint64_t next_batch;  /* Deadline for the next batch */
+    uint64_t next_refresh;  /* Deadline for the next refresh */
+    uint64_t last_batch;  /* When the last batch was released */
+    uint64_t last_refresh;  /* When the last refresh was released */
+    uint8_t is_refresh_start;  /* Next batch is the first of a refresh */
+
+    struct interval_stats gaps;
+    struct interval_stats refreshes;
+};
+
+/* Tracks the ideal start time of each GIF frame, so late frames are
+   made up for instead of shifting the rest of the animation */
+struct frame_clock {
+    uint64_t next;  /* Ideal start of the next frame, unit: ns */
+
+    /* Counts since the last report, updated atomically */
+    uint64_t shown;
+    uint64_t skipped;
+};
+
+uint64_t time_now_ns(void);
+void time_wait_until(uint64_t deadline, uint64_t spin);
+
+void interval_stats_reset(struct interval_stats *stats);
+void interval_stats_add(struct interval_stats *stats, uint64_t interval);
+
+void pacer_init(struct pacer *pacer, uint64_t gap, uint64_t refresh);
+void pacer_calibrate(struct pacer *pacer);
+void pacer_wait_refresh(struct pacer *pacer);
+void pacer_wait_batch(struct pacer *pacer);
+void pacer_report(struct pacer *pacer, FILE *file);
+
+void frame_clock_start(struct frame_clock *clock, uint64_t now, uint16_t delay);
+uint8_t frame_clock_advance(struct frame_clock *clock, uint64_t now, uint16_t delay);
+void frame_clock_report(struct frame_clock *clock, FILE *file);
+
+#endif
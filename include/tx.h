@@ -0,0 +1,70 @@
+#ifndef TX_H
+#define TX_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <linux/if_packet.h>
+
+#include "global_defines.h"
+#include "packet.h"
+
+#define TX_RING_FRAME_SIZE 256  /* Must hold TPACKET2_HDRLEN + FRAME_BYTES */
+#define TX_RING_BLOCK_SIZE 4096
+#define TX_RING_POLL_MS 10  /* Longest wait for a ring frame before dropping the rest of a batch */
+
+#define TX_PCAP_MAGIC 0xA1B2C3D4  /* Microsecond timestamps */
+#define TX_PCAP_LINKTYPE_ETHERNET 1
+#define TX_PCAP_SNAPLEN 65535
+
+enum tx_mode {
+    TX_SENDTO,  /* One sendto per packet */
+    TX_MMSG,  /* One sendmmsg per batch */
+    TX_RING,  /* PACKET_TX_RING, one kick per batch */
+
+    /* Stand-ins for the FPGA link, none of which need root */
+    TX_NULL,  /* Packets are dropped */
+    TX_PCAP,  /* Appended to a pcap file, one writev per batch */
+    TX_UDP,  /* Each Ethernet frame as a UDP datagram, one sendmmsg per batch */
+    TX_UNIX  /* Same over a UNIX datagram socket */
+};
+
+/* Record header preceding each packet in a pcap file */
+struct tx_pcap_record {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+/* Transmit backend for packet sets: a raw socket on the FPGA link, or a
+   sink standing in for it */
+struct tx {
+    enum tx_mode mode;
+    int fd;
+    struct sockaddr_ll address;
+    uint8_t header[HEADER_BYTES];  /* Ethernet header for this interface */
+
+    /* TX_MMSG, TX_UDP and TX_UNIX */
+    struct mmsghdr msgs[CHUNK_LEDS];
+    struct iovec iovs[CHUNK_LEDS];
+    struct sockaddr_un unix_address;  /* TX_UNIX, every send goes to it */
+
+    /* TX_PCAP, a record header and a packet per packet */
+    struct tx_pcap_record records[CHUNK_LEDS];
+    struct iovec pcap_iovs[2 * CHUNK_LEDS];
+
+    /* TX_RING */
+    uint8_t *ring;
+    size_t ring_size;
+    uint32_t ring_frames;
+    uint32_t ring_index;  /* Next ring frame to fill */
+};
+
+int tx_parse_mode(enum tx_mode *mode, const char **target, const char *name);
+int tx_open(struct tx *tx, enum tx_mode mode, const char *target);
+int tx_send(struct tx *tx, struct packet_set *set, uint16_t first, uint16_t count);
+void tx_close(struct tx *tx);
+
+#endif
@@ -3,7 +3,15 @@
 
 #include <stdint.h>
 
+/* Pixel rectangle, empty if w or h is 0 */
+struct rect {
+    uint16_t left;
+    uint16_t top;
+    uint16_t w;
+    uint16_t h;
+};
+
 uint16_t combine_bytes(uint8_t lsb, uint8_t msb);
+void rect_union(struct rect *rect, const struct rect *other);
 
 #endif
-
@@ -0,0 +1,85 @@
+#include <math.h>
+
+#include "color.h"
+
+void color_table_init(
+    struct color_table *table,
+    double max_brightness,
+    double gamma,
+    const double balance[COLOR_CHANNELS]
+) {
+    /* Table for level l maps v to v^gamma scaled by l/255*max_brightness and
+       the channel balance. Starts at level 0 (off) */
+
+    uint16_t level, v;
+    uint8_t c;
+    double brightness;
+    double linear[256];
+
+    for (v = 0; v < 256; ++v) {
+        /* Exact for gamma 1, so output matches plain scaling */
+        linear[v] = gamma == 1 ? v : 255 * pow(v / 255.0, gamma);
+    }
+
+    for (level = 0; level < COLOR_LEVELS; ++level) {
+        brightness = level / 255.0 * max_brightness;
+        for (c = 0; c < COLOR_CHANNELS; ++c) {
+            for (v = 0; v < 256; ++v) {
+                table->luts[level].ch[c][v] = (uint8_t) fmin(linear[v] * brightness * balance[c], 255);
+            }
+        }
+    }
+
+    table->current = &table->luts[0];
+}
+
+void color_table_init_scaled(struct color_table *table, double max_scale) {
+    /* Table for level l scales v by l/255*max_scale, for colors that had a
+       brightness applied already. Rounded, so a scale of about 1 keeps
+       them as they are */
+
+    uint16_t level, v;
+    uint8_t c;
+    double scale;
+
+    for (level = 0; level < COLOR_LEVELS; ++level) {
+        scale = level / 255.0 * max_scale;
+        for (c = 0; c < COLOR_CHANNELS; ++c) {
+            for (v = 0; v < 256; ++v) {
+                table->luts[level].ch[c][v] = (uint8_t) fmin(v * scale + 0.5, 255);
+            }
+        }
+    }
+
+    table->current = &table->luts[0];
+}
+
+void color_table_set_level(struct color_table *table, uint8_t level) {
+    /* Safe to call from any thread while another reads the table */
+    __atomic_store_n(&table->current, &table->luts[level], __ATOMIC_RELEASE);
+}
+
+const struct color_lut *color_table_get(struct color_table *table) {
+    /* Table to apply to the next frame. Compare pointers to detect changes */
+    return __atomic_load_n(&table->current, __ATOMIC_ACQUIRE);
+}
+
+uint8_t color_table_level(struct color_table *table, const struct color_lut *lut) {
+    /* Brightness level of a table returned by color_table_get */
+    return (uint8_t) (lut - table->luts);
+}
+
+uint8_t color_lut_is_identity(const struct color_lut *lut) {
+    uint16_t v;
+    uint8_t c;
+
+    for (c = 0; c < COLOR_CHANNELS; ++c) {
+        for (v = 0; v < 256; ++v) {
+            if (lut->ch[c][v] != v) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
@@ -0,0 +1,471 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+#include "compose.h"
+#include "frame_store.h"
+#include "timing.h"
+
+#define COMPOSE_BYTES (LED_ROWS * LED_COLS * LED_CHANNELS)
+
+static const struct rect compose_canvas = {0, 0, LED_COLS, LED_ROWS};
+
+int compose_parse_blend(uint8_t *mode, const char *name) {
+    if (!strcmp(name, "normal")) {
+        *mode = BLEND_NORMAL;
+    }
+    else if (!strcmp(name, "add")) {
+        *mode = BLEND_ADD;
+    }
+    else if (!strcmp(name, "multiply")) {
+        *mode = BLEND_MULTIPLY;
+    }
+    else if (!strcmp(name, "screen")) {
+        *mode = BLEND_SCREEN;
+    }
+    else {
+        printf("Error: Unknown blend mode %s\n", name);
+        return ERROR_OUT;
+    }
+
+    return SUCC_OUT;
+}
+
+int compose_parse_transition(uint8_t *type, uint64_t *duration, const char *arg) {
+    /* Transition given as cut, fade:ms or wipe:ms */
+
+    const char *colon = strchr(arg, ':');
+    size_t name_length = colon ? (size_t) (colon - arg) : strlen(arg);
+    char *end;
+    double ms = 0;
+
+    if (!strncmp(arg, "cut", name_length) && name_length == 3) {
+        *type = TRANSITION_CUT;
+    }
+    else if (!strncmp(arg, "fade", name_length) && name_length == 4) {
+        *type = TRANSITION_FADE;
+    }
+    else if (!strncmp(arg, "wipe", name_length) && name_length == 4) {
+        *type = TRANSITION_WIPE;
+    }
+    else {
+        printf("Error: Unknown transition %s\n", arg);
+        return ERROR_OUT;
+    }
+
+    if (*type != TRANSITION_CUT) {
+        if (!colon || (ms = strtod(colon + 1, &end)) <= 0 || *end) {
+            printf("Error: Transition must be given as %.*s:ms\n", (int) name_length, arg);
+            return ERROR_OUT;
+        }
+    }
+    *duration = ms * 1000000;
+
+    return SUCC_OUT;
+}
+
+static inline uint8_t compose_div255(uint32_t x) {
+    /* x / 255 rounded, for x up to 255 * 255 */
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static inline uint8_t compose_blend_value(uint8_t src, uint8_t dst, uint8_t mode) {
+    switch (mode) {
+        case BLEND_ADD:
+            return src + dst > 255 ? 255 : src + dst;
+        case BLEND_MULTIPLY:
+            return compose_div255(src * dst);
+        case BLEND_SCREEN:
+            return 255 - compose_div255((255 - src) * (255 - dst));
+        default:
+            return src;
+    }
+}
+
+static void compose_blend_scalar(uint8_t *dst, const uint8_t *src, size_t bytes, uint8_t opacity, uint8_t mode) {
+    size_t i;
+
+    for (i = 0; i < bytes; ++i) {
+        dst[i] = compose_div255(
+            compose_blend_value(src[i], dst[i], mode) * opacity + dst[i] * (255 - opacity)
+        );
+    }
+}
+
+#if defined(__SSE2__)
+static inline __m128i compose_div255_sse2(__m128i x) {
+    /* Same as compose_div255 on 16-bit lanes */
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+static inline __m128i compose_blend_half_sse2(__m128i src, __m128i dst, __m128i opacity, uint8_t mode) {
+    /* Blend and mix 8 values, widened to 16 bits */
+
+    const __m128i max = _mm_set1_epi16(255);
+
+    if (mode == BLEND_MULTIPLY) {
+        src = compose_div255_sse2(_mm_mullo_epi16(src, dst));
+    }
+    else if (mode == BLEND_SCREEN) {
+        src = _mm_sub_epi16(max, compose_div255_sse2(
+            _mm_mullo_epi16(_mm_sub_epi16(max, src), _mm_sub_epi16(max, dst))
+        ));
+    }
+
+    return compose_div255_sse2(_mm_add_epi16(
+        _mm_mullo_epi16(src, opacity),
+        _mm_mullo_epi16(dst, _mm_sub_epi16(max, opacity))
+    ));
+}
+
+static void compose_blend_sse2(uint8_t *dst, const uint8_t *src, size_t bytes, uint8_t opacity, uint8_t mode) {
+    /* Same output as compose_blend_scalar, 16 values at a time */
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha = _mm_set1_epi16(opacity);
+    __m128i s, d;
+    size_t i;
+
+    for (i = 0; i + 16 <= bytes; i += 16) {
+        s = _mm_loadu_si128((const __m128i *) (src + i));
+        d = _mm_loadu_si128((const __m128i *) (dst + i));
+        if (mode == BLEND_ADD) {
+            s = _mm_adds_epu8(s, d);
+        }
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(
+            compose_blend_half_sse2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), alpha, mode),
+            compose_blend_half_sse2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), alpha, mode)
+        ));
+    }
+
+    compose_blend_scalar(dst + i, src + i, bytes - i, opacity, mode);
+}
+#endif
+
+void compose_blend(uint8_t *dst, const uint8_t *src, size_t bytes, uint8_t opacity, uint8_t mode) {
+    /* Blend src over dst with the given opacity (0-255) */
+
+    #if defined(__SSE2__)
+        compose_blend_sse2(dst, src, bytes, opacity, mode);
+    #else
+        compose_blend_scalar(dst, src, bytes, opacity, mode);
+    #endif
+}
+
+void compositor_init(struct compositor *compositor, uint8_t transition, uint64_t transition_ns) {
+    memset(compositor->layers, 0, sizeof(compositor->layers));
+    memset(compositor->sources, 0, sizeof(compositor->sources));
+    compositor->transition = transition;
+    compositor->transition_ns = transition_ns;
+    compositor->transition_start = 0;
+    compositor->transition_end = 0;
+    compositor->next_step = UINT64_MAX;
+}
+
+static void compositor_free_source(struct layer_source *source) {
+    if (source->gif) {
+        gif_free(source->gif);
+        free(source->gif);
+        source->gif = 0;
+    }
+    free(source->canvas);
+    source->canvas = 0;
+}
+
+void compositor_set_layer(
+    struct compositor *compositor,
+    uint8_t index,
+    const struct layer *layer,
+    struct gif *gif
+) {
+    /* Replace a layer, drawn from the next step. With gif (loaded with
+       frame_store_load, not lazily) the layer plays it, and takes ownership
+       of it, otherwise it is layer's color */
+
+    struct layer_source *source = &compositor->sources[index];
+    uint16_t i;
+    uint8_t *fill = (uint8_t *) compositor->fills[index];
+
+    compositor->layers[index] = *layer;
+    compositor_free_source(source);
+    if (gif) {
+        source->gif = gif;
+        source->canvas = (uint8_t *) malloc(gif->w * gif->h);
+        source->frame_index = gif->frames.length - 1;  /* First step wraps to frame 0 */
+        source->next = 0;
+    }
+    else {
+        for (i = 0; i < LED_ROWS * LED_COLS; ++i) {
+            memcpy(fill + i * LED_CHANNELS, layer->color, LED_CHANNELS);
+        }
+    }
+    compositor->next_step = 0;
+}
+
+void compositor_free(struct compositor *compositor) {
+    uint8_t i;
+
+    for (i = 0; i < COMPOSE_LAYERS; ++i) {
+        compositor_free_source(&compositor->sources[i]);
+    }
+}
+
+void compositor_begin_transition(
+    struct compositor *compositor,
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS],
+    uint64_t now
+) {
+    /* Keep colors, the last frame of the outgoing GIF, to transition from */
+
+    if (compositor->transition == TRANSITION_CUT) {
+        return;
+    }
+
+    memcpy(compositor->from, colors, sizeof(compositor->from));
+    compositor->transition_start = now;
+    compositor->transition_end = now + compositor->transition_ns;
+}
+
+uint8_t compositor_is_active(struct compositor *compositor, uint64_t now) {
+    /* Whether anything is drawn over the GIF */
+
+    uint8_t i;
+
+    if (now < compositor->transition_end) {
+        return 1;
+    }
+    for (i = 0; i < COMPOSE_LAYERS; ++i) {
+        if (compositor->layers[i].opacity) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void compose_source(struct layer_source *source, uint64_t now, const struct color_lut *lut) {
+    /* Composite the layer GIF's frames up to the one due at now. Far behind,
+       e.g. after a pause, it carries on from the next frame rather than
+       catching up */
+
+    struct frame *frame;
+    const uint8_t *ct_indices;
+
+    if (source->next && now > source->next + FRAME_CLOCK_RESYNC_NS) {
+        source->next = now;
+    }
+
+    while (now >= source->next) {
+        source->frame_index = (source->frame_index + 1) % source->gif->frames.length;
+        frame = (struct frame *) dyn_arr_get(&source->gif->frames, source->frame_index);
+        ct_indices = frame_store_expand(source->gif, source->frame_index, source->canvas);
+        if (!source->frame_index) {
+            compose_first_frame(&source->frame, source->gif, ct_indices, frame->rect.w, lut);
+        }
+        else {
+            compose_frame(&source->frame, source->gif, frame, ct_indices, frame->rect.w, lut);
+        }
+
+        if (source->gif->frames.length == 1) {
+            /* Still image, never drawn again */
+            source->next = UINT64_MAX;
+            break;
+        }
+        /* Zero delay frames are shown for the shortest delay */
+        source->next = (source->next ? source->next : now) + (frame->delay ? frame->delay : 1) * FRAME_DELAY_NS;
+    }
+}
+
+void compose_layers(
+    struct compositor *compositor,
+    struct color_frame *color_frame,
+    uint64_t now,
+    const struct color_lut *lut
+) {
+    /* Draw the stack over color_frame->colors into color_frame->adjusted.
+       colors itself is left alone, later frames are composited onto it */
+
+    uint8_t *out = (uint8_t *) compositor->colors;
+    uint8_t *adjusted = (uint8_t *) color_frame->adjusted;
+    uint64_t progress;  /* Unit: 1/256 of the transition */
+    uint16_t edge;
+    uint16_t i;
+
+    memcpy(compositor->colors, color_frame->colors, sizeof(compositor->colors));
+    compositor->next_step = UINT64_MAX;
+
+    if (now < compositor->transition_end) {
+        progress = (now - compositor->transition_start) * 256 / compositor->transition_ns;
+        if (compositor->transition == TRANSITION_FADE) {
+            compose_blend(out, (const uint8_t *) compositor->from, COMPOSE_BYTES, 255 - progress, BLEND_NORMAL);
+        }
+        else {
+            /* Incoming GIF shows left of the edge */
+            edge = progress * LED_COLS / 256;
+            for (i = 0; i < LED_ROWS; ++i) {
+                memcpy(compositor->colors[i][edge], compositor->from[i][edge], (LED_COLS - edge) * LED_CHANNELS);
+            }
+        }
+        compositor->next_step = now + COMPOSE_STEP_NS;
+        if (compositor->next_step > compositor->transition_end) {
+            /* Last step draws the incoming GIF alone */
+            compositor->next_step = compositor->transition_end;
+        }
+    }
+
+    for (i = 0; i < COMPOSE_LAYERS; ++i) {
+        if (!compositor->layers[i].opacity) {
+            continue;
+        }
+        if (compositor->sources[i].gif) {
+            compose_source(&compositor->sources[i], now, lut);
+            if (compositor->sources[i].next < compositor->next_step) {
+                compositor->next_step = compositor->sources[i].next;
+            }
+        }
+        compose_blend(
+            out,
+            compositor->sources[i].gif ?
+                (const uint8_t *) compositor->sources[i].frame.colors :
+                (const uint8_t *) compositor->fills[i],
+            COMPOSE_BYTES,
+            compositor->layers[i].opacity, compositor->layers[i].mode
+        );
+    }
+
+    for (i = 0; i < LED_ROWS * LED_COLS * LED_CHANNELS; i += LED_CHANNELS) {
+        adjusted[i] = lut->ch[0][out[i]];
+        adjusted[i + 1] = lut->ch[1][out[i + 1]];
+        adjusted[i + 2] = lut->ch[2][out[i + 2]];
+    }
+
+    /* Next frame derives adjusted from colors again */
+    color_frame->lut = 0;
+    color_frame->dirty = compose_canvas;
+}
+
+static void compose_adjust(struct color_frame *color_frame, const struct color_lut *lut) {
+    /* Derive all of adjusted from colors */
+
+    uint8_t *colors = (uint8_t *) color_frame->colors;
+    uint8_t *adjusted = (uint8_t *) color_frame->adjusted;
+    uint16_t i;
+
+    for (i = 0; i < COMPOSE_BYTES; i += LED_CHANNELS) {
+        adjusted[i] = lut->ch[0][colors[i]];
+        adjusted[i + 1] = lut->ch[1][colors[i + 1]];
+        adjusted[i + 2] = lut->ch[2][colors[i + 2]];
+    }
+    color_frame->lut = lut;
+    color_frame->dirty = compose_canvas;
+}
+
+static const struct palette *compose_palette(
+    struct gif *gif,
+    struct frame *frame,
+    const struct color_lut *lut
+) {
+    /* frame's palette, with adjusted derived for lut */
+
+    struct palette *palette = gif_palette(gif, frame);
+    uint16_t i;
+
+    if (palette->lut != lut) {
+        for (i = 0; i < 256; ++i) {
+            palette->adjusted[i][0] = lut->ch[0][palette->grb[i][0]];
+            palette->adjusted[i][1] = lut->ch[1][palette->grb[i][1]];
+            palette->adjusted[i][2] = lut->ch[2][palette->grb[i][2]];
+        }
+        palette->lut = lut;
+    }
+
+    return palette;
+}
+
+static void compose_rect(
+    struct color_frame *color_frame,
+    struct gif *gif,
+    struct frame *frame,
+    const uint8_t *ct_indices,
+    uint16_t stride,
+    const struct color_lut *lut
+) {
+    /* Copy the non-transparent pixels of frame->rect into color_frame */
+
+    const struct palette *palette = compose_palette(gif, frame, lut);
+    const struct rect *rect = &frame->rect;
+    uint16_t i, j;
+    uint8_t ct_index;
+    uint8_t *color;
+    uint8_t *adjusted;
+
+    for (i = 0; i < rect->h; ++i) {
+        color = color_frame->colors[rect->top + i][rect->left];
+        adjusted = color_frame->adjusted[rect->top + i][rect->left];
+        for (j = 0; j < rect->w; ++j, color += LED_CHANNELS, adjusted += LED_CHANNELS) {
+            ct_index = ct_indices[i * stride + j];
+            if (frame->has_transparency && ct_index == frame->transparent_index) {
+                /* Transparent pixel retains same color */
+                continue;
+            }
+
+            memcpy(color, palette->grb[ct_index], LED_CHANNELS);
+            memcpy(adjusted, palette->adjusted[ct_index], LED_CHANNELS);
+        }
+    }
+}
+
+void compose_frame(
+    struct color_frame *color_frame,
+    struct gif *gif,
+    struct frame *frame,
+    const uint8_t *ct_indices,
+    uint16_t stride,
+    const struct color_lut *lut
+) {
+    /* Composite frame onto color_frame. ct_indices holds the rows of
+       frame->rect, stride apart, and only that rect changes unless adjusted
+       has to be derived again for a new table */
+
+    compose_rect(color_frame, gif, frame, ct_indices, stride, lut);
+
+    if (lut != color_frame->lut) {
+        compose_adjust(color_frame, lut);
+    }
+    else {
+        rect_union(&color_frame->dirty, &frame->rect);
+    }
+}
+
+void compose_first_frame(
+    struct color_frame *color_frame,
+    struct gif *gif,
+    const uint8_t *ct_indices,
+    uint16_t stride,
+    const struct color_lut *lut
+) {
+    /* Draw the first frame over the background color, as ct_indices in
+       compose_frame */
+
+    uint8_t *colors = (uint8_t *) color_frame->colors;
+    struct frame *frame;
+    const uint8_t *bg;
+    uint16_t i;
+
+    frame = (struct frame *) dyn_arr_get(&(gif->frames), 0);
+
+    /* Transparent and out of bounds pixels show the background */
+    bg = gif_palette(gif, frame)->grb[gif->bg_index];
+    for (i = 0; i < COMPOSE_BYTES; i += LED_CHANNELS) {
+        memcpy(colors + i, bg, LED_CHANNELS);
+    }
+
+    compose_rect(color_frame, gif, frame, ct_indices, stride, lut);
+    compose_adjust(color_frame, lut);
+}
@@ -0,0 +1,600 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "global_defines.h"
+#include "control.h"
+#include "timing.h"
+#include "frame_store.h"
+
+#define CONTROL_LOAD_NICE 10  /* Loading yields to rendering and sending */
+
+static int control_open_serial(int *fd) {
+    struct termios tty;
+
+    if ((*fd = open(SER_NAME, O_RDONLY | O_NOCTTY | O_NONBLOCK)) < 0) {
+        perror("Error [open serial]");
+        return ERROR_OUT;
+    }
+
+    if (tcgetattr(*fd, &tty) != 0) {
+        perror("Error [tcgetattr]");
+        close(*fd);
+        return ERROR_OUT;
+    }
+
+    cfsetispeed(&tty, B9600);
+
+    tty.c_cflag = (tty.c_cflag & ~CSIZE) | CS8;
+    tty.c_cflag |= (CLOCAL | CREAD);
+    tty.c_cflag &= ~(PARENB | PARODD);
+    tty.c_cflag &= ~CSTOPB;
+    tty.c_cflag &= ~CRTSCTS;
+
+    tty.c_iflag &= ~IGNBRK;
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY);
+
+    tty.c_lflag = 0;
+
+    /* Reads return whatever is available, readiness comes from epoll */
+    tty.c_cc[VMIN] = 0;
+    tty.c_cc[VTIME] = 0;
+
+    if (tcsetattr(*fd, TCSANOW, &tty) != 0) {
+        perror("Error [tcsetattr]");
+        close(*fd);
+        return ERROR_OUT;
+    }
+
+    return SUCC_OUT;
+}
+
+static int control_open_socket(int *fd, const char *path) {
+    /* Datagram socket, one command per datagram */
+
+    struct sockaddr_un address;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("Error: Command socket path too long\n");
+        return ERROR_OUT;
+    }
+
+    if ((*fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) {
+        perror("Error [socket]");
+        return ERROR_OUT;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);  /* Left over from a previous run */
+
+    if (bind(*fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        perror("Error [bind command socket]");
+        close(*fd);
+        return ERROR_OUT;
+    }
+
+    return SUCC_OUT;
+}
+
+static uint8_t control_push(struct control *control, struct command *command) {
+    /* Queue a command for the render thread, return 0 if the queue is full */
+
+    struct command_queue *queue = &control->queue;
+    uint64_t wake = 1;
+
+    if (queue->tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == CONTROL_QUEUE_LENGTH) {
+        return 0;
+    }
+
+    queue->commands[queue->tail % CONTROL_QUEUE_LENGTH] = *command;
+    __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
+
+    if (write(control->wake_fd, &wake, sizeof(wake)) < 0) {
+        perror("Error [write wake]");
+    }
+
+    return 1;
+}
+
+static void control_read_serial(struct control *control, uint32_t events) {
+    /* Only the latest brightness byte matters. Once the device hangs up
+       (reads return 0, or it errors) it is closed, epoll would report it
+       ready forever, and the last level is kept */
+
+    uint8_t buffer[64];
+    ssize_t rd_size;
+    ssize_t last_size = 0;
+
+    while ((rd_size = read(control->ser_fd, buffer, sizeof(buffer))) > 0) {
+        last_size = rd_size;
+    }
+
+    if (last_size > 0) {
+        color_table_set_level(control->colors, buffer[last_size - 1]);
+    }
+
+    if (rd_size < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("Error [read serial]");
+    }
+    else if (rd_size < 0 && !(events & (EPOLLHUP | EPOLLERR))) {
+        /* Drained */
+        return;
+    }
+    printf("Error: Serial input lost, keeping the current brightness\n");
+    if (epoll_ctl(control->epoll_fd, EPOLL_CTL_DEL, control->ser_fd, NULL) < 0) {
+        perror("Error [epoll_ctl]");
+    }
+    close(control->ser_fd);
+    control->ser_fd = -1;
+}
+
+static int control_parse_layer(struct command *command, char *path, const char *text) {
+    /* "layer N off", "layer N RRGGBB opacity [mode]" or
+       "layer N gif PATH opacity [mode]", opacity 0-255. A GIF layer must be
+       the floor's size, its path is left in path, otherwise path is empty.
+       Transparent pixels show the GIF's background color, so an overlay on
+       black is drawn with add or screen, one on white with multiply */
+
+    int index;
+    unsigned int rgb = 0;
+    int opacity;
+    char word[16];
+    char mode[16] = "normal";
+
+    path[0] = 0;
+    if (sscanf(text, "layer %d %15s", &index, word) == 2 && !strcmp(word, "off")) {
+        memset(&command->layer, 0, sizeof(command->layer));
+    }
+    else if (
+        sscanf(text, "layer %d gif %4095s %d %15s", &index, path, &opacity, mode) >= 3 ||
+        sscanf(text, "layer %d %6x %d %15s", &index, &rgb, &opacity, mode) >= 3
+    ) {
+        if (opacity < 0 || opacity > 255) {
+            printf("Error: Layer opacity must be 0 to 255\n");
+            return ERROR_OUT;
+        }
+        if (compose_parse_blend(&command->layer.mode, mode) == ERROR_OUT) {
+            return ERROR_OUT;
+        }
+        command->layer.color[0] = (rgb >> 8) & 0xFF;
+        command->layer.color[1] = (rgb >> 16) & 0xFF;
+        command->layer.color[2] = rgb & 0xFF;
+        command->layer.opacity = opacity;
+    }
+    else {
+        printf("Error: Layer must be given as layer N RRGGBB opacity [mode], layer N gif PATH opacity [mode] or layer N off\n");
+        return ERROR_OUT;
+    }
+
+    if (index < 0 || index >= COMPOSE_LAYERS) {
+        printf("Error: Layer must be 0 to %d\n", COMPOSE_LAYERS - 1);
+        return ERROR_OUT;
+    }
+    command->layer_index = index;
+
+    return SUCC_OUT;
+}
+
+static void control_want_load(struct control *control, uint8_t target, const char *path, const struct layer *layer) {
+    /* Hand a GIF to the loader, or with a null path drop any load in
+       progress for target */
+
+    pthread_mutex_lock(&control->lock);
+    ++control->load_serials[target];
+    control->is_load_wanted[target] = path != 0;
+    if (path) {
+        strcpy(control->load_paths[target], path);
+        if (layer) {
+            control->load_layers[target] = *layer;
+        }
+        pthread_cond_signal(&control->load_wake);
+    }
+    if (control->loaded[target]) {
+        gif_free(control->loaded[target]);
+        free(control->loaded[target]);
+        control->loaded[target] = 0;
+    }
+    pthread_mutex_unlock(&control->lock);
+}
+
+static void control_handle_command(struct control *control, char *text) {
+    struct command command;
+    char path[CONTROL_COMMAND_BYTES];
+    int level;
+
+    /* Commands are plain text, optionally newline terminated */
+    text[strcspn(text, "\r\n")] = 0;
+    command.gif = 0;
+
+    if (!strncmp(text, "load ", 5)) {
+        /* Queued by control_read_loaded once loaded. A load asked for while
+           another is in progress follows it */
+        control_want_load(control, 0, text + 5, 0);
+        return;
+    }
+    else if (sscanf(text, "brightness %d", &level) == 1) {
+        if (level < 0 || level >= COLOR_LEVELS) {
+            printf("Error: Brightness must be 0 to %d\n", COLOR_LEVELS - 1);
+            return;
+        }
+        color_table_set_level(control->colors, level);
+        return;
+    }
+    else if (!strcmp(text, "pause")) {
+        command.type = COMMAND_PAUSE;
+    }
+    else if (!strcmp(text, "resume")) {
+        command.type = COMMAND_RESUME;
+    }
+    else if (!strcmp(text, "next")) {
+        command.type = COMMAND_NEXT;
+    }
+    else if (!strncmp(text, "layer ", 6)) {
+        if (control_parse_layer(&command, path, text) == ERROR_OUT) {
+            return;
+        }
+        if (path[0]) {
+            /* Queued like load, once loaded */
+            control_want_load(control, 1 + command.layer_index, path, &command.layer);
+            return;
+        }
+        control_want_load(control, 1 + command.layer_index, 0, 0);
+        command.type = COMMAND_LAYER;
+    }
+    else {
+        printf("Error: Unknown command '%s'\n", text);
+        return;
+    }
+
+    if (!control_push(control, &command)) {
+        printf("Error: Command queue full, dropping '%s'\n", text);
+        if (command.gif) {
+            gif_free(command.gif);
+            free(command.gif);
+        }
+    }
+}
+
+static void control_read_socket(struct control *control) {
+    char text[CONTROL_COMMAND_BYTES];
+    ssize_t rd_size;
+
+    while ((rd_size = recv(control->sock_fd, text, sizeof(text) - 1, 0)) > 0) {
+        text[rd_size] = 0;
+        control_handle_command(control, text);
+    }
+}
+
+static void control_read_loaded(struct control *control) {
+    /* Queue the GIFs the loader has finished */
+
+    struct command command;
+    uint64_t loaded;
+    uint8_t i;
+
+    if (read(control->loaded_fd, &loaded, sizeof(loaded)) < 0) {
+        return;
+    }
+
+    for (i = 0; i < CONTROL_LOAD_TARGETS; ++i) {
+        pthread_mutex_lock(&control->lock);
+        command.gif = control->loaded[i];
+        command.layer = control->loaded_layers[i];
+        control->loaded[i] = 0;
+        pthread_mutex_unlock(&control->lock);
+
+        if (!command.gif) {
+            continue;
+        }
+        if (i) {
+            command.type = COMMAND_LAYER;
+            command.layer_index = i - 1;
+        }
+        else {
+            command.type = COMMAND_LOAD;
+        }
+        if (!control_push(control, &command)) {
+            printf("Error: Command queue full, dropping loaded GIF\n");
+            gif_free(command.gif);
+            free(command.gif);
+        }
+    }
+}
+
+static void *control_load_thread_func(void *args) {
+    /* Load the latest GIF asked for each target, off the control thread so
+       brightness, commands and signals are handled while it decodes. Layers
+       are decoded up front, the compositor expands their frames itself */
+
+    struct control *control = (struct control *) args;
+    char path[CONTROL_COMMAND_BYTES];
+    struct layer layer;
+    struct gif *gif;
+    uint32_t serial;
+    uint64_t loaded = 1;
+    uint8_t target = 0;
+
+    /* Decode threads started from here inherit this */
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), CONTROL_LOAD_NICE) < 0) {
+        perror("Error [setpriority]");
+    }
+
+    pthread_mutex_lock(&control->lock);
+    while (1) {
+        while (!control->load_stop) {
+            for (target = 0; target < CONTROL_LOAD_TARGETS && !control->is_load_wanted[target]; ++target);
+            if (target < CONTROL_LOAD_TARGETS) {
+                break;
+            }
+            pthread_cond_wait(&control->load_wake, &control->lock);
+        }
+        if (control->load_stop) {
+            break;
+        }
+        control->is_load_wanted[target] = 0;
+        strcpy(path, control->load_paths[target]);
+        layer = control->load_layers[target];
+        serial = control->load_serials[target];
+        pthread_mutex_unlock(&control->lock);
+
+        gif = frame_store_load(path, target ? 0 : control->lazy_decode, &control->scaling);
+
+        pthread_mutex_lock(&control->lock);
+        if (!gif) {
+            continue;
+        }
+        if (serial != control->load_serials[target]) {
+            /* Replaced or turned off while loading */
+            gif_free(gif);
+            free(gif);
+            continue;
+        }
+        if (control->loaded[target]) {
+            /* Superseded before the control thread queued it */
+            gif_free(control->loaded[target]);
+            free(control->loaded[target]);
+        }
+        control->loaded[target] = gif;
+        control->loaded_layers[target] = layer;
+        if (write(control->loaded_fd, &loaded, sizeof(loaded)) < 0) {
+            perror("Error [write loaded]");
+        }
+    }
+    pthread_mutex_unlock(&control->lock);
+
+    return 0;
+}
+
+static void *control_thread_func(void *args) {
+    struct control *control = (struct control *) args;
+    struct epoll_event events[CONTROL_EPOLL_EVENTS];
+    struct signalfd_siginfo info;
+    struct command command;
+    int n, i;
+
+    while (1) {
+        if ((n = epoll_wait(control->epoll_fd, events, CONTROL_EPOLL_EVENTS, -1)) < 0) {
+            perror("Error [epoll_wait]");
+            continue;
+        }
+
+        for (i = 0; i < n; ++i) {
+            if (events[i].data.fd == control->ser_fd) {
+                control_read_serial(control, events[i].events);
+            }
+            else if (events[i].data.fd == control->sock_fd) {
+                control_read_socket(control);
+            }
+            else if (events[i].data.fd == control->loaded_fd) {
+                control_read_loaded(control);
+            }
+            else if (events[i].data.fd == control->sig_fd) {
+                if (read(control->sig_fd, &info, sizeof(info)) != sizeof(info)) {
+                    continue;
+                }
+
+                /* Render thread exits on quit, the transmit loop polls stop */
+                command.type = COMMAND_QUIT;
+                command.gif = 0;
+                while (!control_push(control, &command)) {
+                    usleep(1000);
+                }
+                __atomic_store_n(&control->stop, 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        }
+    }
+}
+
+static int control_watch(struct control *control, int fd) {
+    struct epoll_event event;
+
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(control->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        perror("Error [epoll_ctl]");
+        return ERROR_OUT;
+    }
+
+    return SUCC_OUT;
+}
+
+int control_start(
+    struct control *control,
+    struct color_table *colors,
+    const char *socket_path,
+    uint8_t lazy_decode,
+    const struct scale_options *scaling
+) {
+    /* Must be called before starting any other thread, since termination
+       signals are blocked in the caller for signalfd to see them */
+
+    sigset_t signals;
+
+    control->colors = colors;
+    control->lazy_decode = lazy_decode;
+    control->scaling = *scaling;
+    control->socket_path = socket_path;
+    control->queue.head = 0;
+    control->queue.tail = 0;
+    control->stop = 0;
+    memset(control->load_serials, 0, sizeof(control->load_serials));
+    memset(control->is_load_wanted, 0, sizeof(control->is_load_wanted));
+    control->load_stop = 0;
+    memset(control->loaded, 0, sizeof(control->loaded));
+    pthread_mutex_init(&control->lock, NULL);
+    pthread_cond_init(&control->load_wake, NULL);
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if ((control->sig_fd = signalfd(-1, &signals, SFD_NONBLOCK)) < 0) {
+        perror("Error [signalfd]");
+        return ERROR_OUT;
+    }
+    if ((control->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0 ||
+        (control->loaded_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        perror("Error [eventfd]");
+        return ERROR_OUT;
+    }
+    if (control_open_socket(&control->sock_fd, socket_path) == ERROR_OUT) {
+        return ERROR_OUT;
+    }
+    if ((control->epoll_fd = epoll_create1(0)) < 0) {
+        perror("Error [epoll_create1]");
+        return ERROR_OUT;
+    }
+
+    if (control_open_serial(&control->ser_fd) == ERROR_OUT) {
+        /* Run at full brightness without serial input */
+        control->ser_fd = -1;
+        color_table_set_level(colors, COLOR_LEVELS - 1);
+    }
+    else if (control_watch(control, control->ser_fd) == ERROR_OUT) {
+        return ERROR_OUT;
+    }
+
+    if (control_watch(control, control->sock_fd) == ERROR_OUT ||
+        control_watch(control, control->sig_fd) == ERROR_OUT ||
+        control_watch(control, control->loaded_fd) == ERROR_OUT) {
+        return ERROR_OUT;
+    }
+
+    if (pthread_create(&control->load_thread, NULL, control_load_thread_func, control) != 0) {
+        printf("Error: Could not start load thread\n");
+        return ERROR_OUT;
+    }
+    if (pthread_create(&control->thread, NULL, control_thread_func, control) != 0) {
+        printf("Error: Could not start control thread\n");
+        return ERROR_OUT;
+    }
+
+    return SUCC_OUT;
+}
+
+uint8_t control_next(struct control *control, struct command *command) {
+    /* Pop the oldest queued command, return 0 if there is none. Render
+       thread only */
+
+    struct command_queue *queue = &control->queue;
+
+    if (queue->head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    *command = queue->commands[queue->head % CONTROL_QUEUE_LENGTH];
+    __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+void control_wait(struct control *control, uint64_t deadline) {
+    /* Sleep until the CLOCK_MONOTONIC deadline (ns) or until a command is
+       queued. UINT64_MAX waits for a command only */
+
+    struct pollfd pfd;
+    struct timespec timeout;
+    uint64_t now_ns = time_now_ns();
+    uint64_t wake;
+
+    pfd.fd = control->wake_fd;
+    pfd.events = POLLIN;
+
+    if (deadline != UINT64_MAX && deadline <= now_ns) {
+        return;
+    }
+    timeout.tv_sec = (deadline - now_ns) / 1000000000ULL;
+    timeout.tv_nsec = (deadline - now_ns) % 1000000000ULL;
+
+    if (ppoll(&pfd, 1, deadline == UINT64_MAX ? NULL : &timeout, NULL) > 0) {
+        /* Clear the wakeup, queued commands are read with control_next */
+        if (read(control->wake_fd, &wake, sizeof(wake)) < 0) {
+            return;
+        }
+    }
+}
+
+uint8_t control_is_stopped(struct control *control) {
+    return __atomic_load_n(&control->stop, __ATOMIC_ACQUIRE);
+}
+
+void control_quit(struct control *control) {
+    /* Shut down as on SIGTERM, from any thread. Stopped as of return, the
+       control thread sees the signal through signalfd and exits */
+
+    __atomic_store_n(&control->stop, 1, __ATOMIC_RELEASE);
+    if (kill(getpid(), SIGTERM) < 0) {
+        perror("Error [kill]");
+    }
+}
+
+void control_stop(struct control *control) {
+    /* Release resources once control_is_stopped */
+
+    uint8_t i;
+
+    pthread_join(control->thread, NULL);
+
+    /* Waits for any load in progress */
+    pthread_mutex_lock(&control->lock);
+    control->load_stop = 1;
+    pthread_cond_signal(&control->load_wake);
+    pthread_mutex_unlock(&control->lock);
+    pthread_join(control->load_thread, NULL);
+    for (i = 0; i < CONTROL_LOAD_TARGETS; ++i) {
+        if (control->loaded[i]) {
+            gif_free(control->loaded[i]);
+            free(control->loaded[i]);
+        }
+    }
+    pthread_mutex_destroy(&control->lock);
+    pthread_cond_destroy(&control->load_wake);
+
+    if (control->ser_fd >= 0) {
+        close(control->ser_fd);
+    }
+    close(control->sock_fd);
+    unlink(control->socket_path);
+    close(control->sig_fd);
+    close(control->wake_fd);
+    close(control->loaded_fd);
+    close(control->epoll_fd);
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "global_defines.h"
+#include "file_map.h"
+
+#define FILE_MAP_READ_BLOCK 65536
+
+static int file_map_read(struct file_map *map, int fd) {
+    /* Fallback for files that cannot be mapped (pipes, some special files):
+       read everything into one growing heap buffer */
+
+    uint8_t *data = 0;
+    size_t capacity = 0;
+    size_t size = 0;
+    ssize_t rd_size;
+
+    while (1) {
+        if (size == capacity) {
+            capacity += FILE_MAP_READ_BLOCK;
+            data = (uint8_t *) realloc(data, capacity);
+        }
+
+        rd_size = read(fd, data + size, capacity - size);
+        if (rd_size < 0) {
+            perror("Error [read]");
+            free(data);
+            return ERROR_OUT;
+        }
+        if (rd_size == 0) {
+            break;
+        }
+        size += rd_size;
+    }
+
+    map->data = data;
+    map->size = size;
+    map->is_mapped = 0;
+
+    return SUCC_OUT;
+}
+
+int file_map_open(struct file_map *map, const char *filename) {
+    int fd;
+    struct stat st;
+    void *data;
+    int status = SUCC_OUT;
+
+    map->data = 0;
+    map->size = 0;
+    map->is_mapped = 0;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        perror("Error [open]");
+        return ERROR_OUT;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (data != MAP_FAILED) {
+            map->data = (const uint8_t *) data;
+            map->size = st.st_size;
+            map->is_mapped = 1;
+        }
+    }
+
+    if (!map->is_mapped) {
+        status = file_map_read(map, fd);
+    }
+
+    close(fd);
+
+    return status;
+}
+
+void file_map_close(struct file_map *map) {
+    if (map->is_mapped) {
+        munmap((void *) map->data, map->size);
+    }
+    else {
+        free((void *) map->data);
+    }
+
+    map->data = 0;
+    map->size = 0;
+    map->is_mapped = 0;
+}
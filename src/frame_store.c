@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global_defines.h"
+#include "frame_store.h"
+
+static uint32_t frame_store_rle_bytes(const uint8_t *ct_indices, uint32_t pixels) {
+    uint32_t i = 0;
+    uint32_t run;
+    uint32_t bytes = 0;
+
+    while (i < pixels) {
+        for (run = 1; i + run < pixels && run < 255 && ct_indices[i + run] == ct_indices[i]; ++run);
+        i += run;
+        bytes += 2;
+    }
+
+    return bytes;
+}
+
+static uint32_t frame_store_delta(
+    const uint8_t *ct_indices,
+    const uint8_t *prev,
+    uint32_t pixels,
+    uint8_t *out
+) {
+    /* Write spans of ct_indices that differ from prev to out (if not null),
+       return the encoded size */
+
+    uint32_t i = 0;
+    uint32_t start, end, gap;
+    uint32_t bytes = 0;
+
+    while (1) {
+        start = i;
+        for (; i < pixels && ct_indices[i] == prev[i]; ++i);
+        if (i == pixels) {
+            break;
+        }
+
+        /* Extend the span over short unchanged gaps */
+        end = i + 1;
+        for (gap = 0; end < pixels && gap <= FRAME_DELTA_MAX_GAP; ++end) {
+            gap = ct_indices[end] == prev[end] ? gap + 1 : 0;
+        }
+        end -= gap;
+
+        if (out) {
+            out[bytes] = (uint8_t) ((i - start) & 0xFF);
+            out[bytes + 1] = (uint8_t) ((i - start) >> 8);
+            out[bytes + 2] = (uint8_t) ((end - i) & 0xFF);
+            out[bytes + 3] = (uint8_t) ((end - i) >> 8);
+            memcpy(out + bytes + 4, ct_indices + i, end - i);
+        }
+        bytes += 4 + end - i;
+        i = end;
+    }
+
+    return bytes;
+}
+
+static void frame_store_encode_frame(struct frame *frame, const uint8_t *prev) {
+    /* Replace frame->ct_indices with the smallest encoding. prev holds the
+       indices of the frame played before this one if it has the same rect,
+       null if there is none */
+
+    uint8_t *ct_indices = frame->ct_indices;
+    uint32_t pixels = frame->rect.w * frame->rect.h;
+    uint32_t i, run;
+    uint32_t bytes;
+    uint8_t max_index = 0;
+
+    frame->encoding = FRAME_RAW;
+    frame->data_bytes = pixels;
+
+    for (i = 0; i < pixels; ++i) {
+        max_index = ct_indices[i] > max_index ? ct_indices[i] : max_index;
+    }
+    if (max_index < 16) {
+        frame->encoding = FRAME_PACKED4;
+        frame->data_bytes = (pixels + 1) / 2;
+    }
+    if ((bytes = frame_store_rle_bytes(ct_indices, pixels)) < frame->data_bytes) {
+        frame->encoding = FRAME_RLE;
+        frame->data_bytes = bytes;
+    }
+    if (prev && pixels <= 0xFFFF &&
+        (bytes = frame_store_delta(ct_indices, prev, pixels, 0)) < frame->data_bytes) {
+        frame->encoding = FRAME_DELTA;
+        frame->data_bytes = bytes;
+    }
+
+    frame->data = (uint8_t *) malloc(frame->data_bytes ? frame->data_bytes : 1);
+
+    switch (frame->encoding) {
+        case FRAME_RAW:
+            memcpy(frame->data, ct_indices, pixels);
+            break;
+
+        case FRAME_PACKED4:
+            memset(frame->data, 0, frame->data_bytes);
+            for (i = 0; i < pixels; ++i) {
+                frame->data[i / 2] |= ct_indices[i] << ((i & 1) * 4);
+            }
+            break;
+
+        case FRAME_RLE:
+            bytes = 0;
+            for (i = 0; i < pixels; i += run) {
+                for (run = 1; i + run < pixels && run < 255 && ct_indices[i + run] == ct_indices[i]; ++run);
+                frame->data[bytes++] = (uint8_t) run;
+                frame->data[bytes++] = ct_indices[i];
+            }
+            break;
+
+        case FRAME_DELTA:
+            frame_store_delta(ct_indices, prev, pixels, frame->data);
+            break;
+    }
+}
+
+void frame_store_encode(struct gif *gif) {
+    /* Encode every decoded frame compactly, freeing its ct_indices. Frames
+       are then read with frame_store_expand, in playback order */
+
+    size_t i;
+    struct frame *frame;
+    struct frame *prev = 0;
+    uint8_t *is_source = (uint8_t *) calloc(gif->frames.length, 1);
+    size_t total_bytes = 0;
+    uint8_t is_delta_base;
+
+    for (i = 0; i < gif->frames.length; ++i) {
+        frame = (struct frame *) dyn_arr_get(&gif->frames, i);
+        is_source[frame->source] |= frame->source != i;
+    }
+
+    for (i = 0; i < gif->frames.length; ++i) {
+        frame = (struct frame *) dyn_arr_get(&gif->frames, i);
+
+        if (frame->source == i) {
+            /* Frame 0 follows the last frame when looping, and is where playback
+               (re)starts, so it is never a delta. Neither are frames repeated
+               later, which are expanded after a different frame */
+            is_delta_base = prev && !is_source[i] && !memcmp(&prev->rect, &frame->rect, sizeof(struct rect));
+            frame_store_encode_frame(frame, is_delta_base ? prev->ct_indices : 0);
+            total_bytes += frame->data_bytes;
+        }
+        else {
+            frame->encoding = FRAME_RAW;
+            frame->data = 0;
+            frame->data_bytes = 0;
+        }
+        prev = frame;
+    }
+
+    /* Raw indices were needed as delta bases until now */
+    for (i = 0; i < gif->frames.length; ++i) {
+        frame = (struct frame *) dyn_arr_get(&gif->frames, i);
+        if (frame->source == i) {
+            free(frame->ct_indices);
+        }
+        frame->ct_indices = 0;
+    }
+    free(is_source);
+
+    #if DEBUG
+        printf(
+            "Frame store: %lu bytes, %lu raw\n",
+            (unsigned long) total_bytes, (unsigned long) gif->w * gif->h * gif->frames.length
+        );
+    #else
+        (void) total_bytes;
+    #endif
+}
+
+uint8_t *frame_store_expand(struct gif *gif, size_t index, uint8_t *canvas) {
+    /* Return the ct_indices of frame index (rect.w * rect.h of them), expanded
+       into canvas if the GIF is encoded. For a FRAME_DELTA frame, canvas must
+       hold the previous frame */
+
+    struct frame *frame = (struct frame *) dyn_arr_get(&gif->frames, index);
+    uint32_t pixels = frame->rect.w * frame->rect.h;
+    const uint8_t *data = frame->data;
+    const uint8_t *end = data + frame->data_bytes;
+    uint8_t *out = canvas;
+    uint32_t i, skip, count;
+
+    if (frame->ct_indices) {
+        return frame->ct_indices;
+    }
+
+    /* Duplicates share the data of their source, which is never a delta */
+    frame = (struct frame *) dyn_arr_get(&gif->frames, frame->source);
+    data = frame->data;
+    end = data + frame->data_bytes;
+
+    switch (frame->encoding) {
+        case FRAME_RAW:
+            memcpy(canvas, data, pixels);
+            break;
+
+        case FRAME_PACKED4:
+            for (i = 0; i + 1 < pixels; i += 2) {
+                canvas[i] = data[i / 2] & 0x0F;
+                canvas[i + 1] = data[i / 2] >> 4;
+            }
+            if (i < pixels) {
+                canvas[i] = data[i / 2] & 0x0F;
+            }
+            break;
+
+        case FRAME_RLE:
+            for (; data < end; data += 2) {
+                memset(out, data[1], data[0]);
+                out += data[0];
+            }
+            break;
+
+        case FRAME_DELTA:
+            while (data < end) {
+                skip = data[0] | (data[1] << 8);
+                count = data[2] | (data[3] << 8);
+                out += skip;
+                memcpy(out, data + 4, count);
+                out += count;
+                data += 4 + count;
+            }
+            break;
+    }
+
+    return canvas;
+}
+
+struct gif *frame_store_load(const char *filename, uint8_t lazy_decode, const struct scale_options *scaling) {
+    /* Load a GIF ready for playback, encoded unless lazy_decode is set and
+       fitted to the floor as scaling says if it is another size. Null on
+       failure */
+
+    struct gif *gif = (struct gif *) malloc(sizeof(struct gif));
+
+    gif_init(gif);
+    gif->lazy_decode = lazy_decode;
+    gif->scaling = *scaling;
+    if (gif_load(gif, filename) == ERROR_OUT) {
+        free(gif);
+        return 0;
+    }
+
+    if (gif->w != LED_COLS || gif->h != LED_ROWS || !gif->frames.length) {
+        printf("Error: GIF must be %dx%d with at least one frame\n", LED_COLS, LED_ROWS);
+        gif_free(gif);
+        free(gif);
+        return 0;
+    }
+
+    if (!gif->lazy_decode) {
+        frame_store_encode(gif);
+    }
+
+    return gif;
+}
@@ -5,270 +5,374 @@
 #define DISPOSAL_BG 2  /* Replace current frame with background color */
 #define DISPOSAL_PREV 3  /* Revert to previous frame */
 
+#define LZW_MAX_CODE_SIZE 12
+#define LZW_MAX_CODES 4096  /* 1 << LZW_MAX_CODE_SIZE */
+#define LZW_NO_CODE 0xFFFF
+
+#define GIF_HASH_OFFSET 0xCBF29CE484222325ULL
+#define GIF_HASH_PRIME 0x100000001B3ULL
+
 void gif_init(struct gif *gif) {
+    gif->lazy_decode = 0;
+    gif->decode_threads = 0;
+    gif->scaling.mode = SCALE_NONE;
+    gif->scaling.filter = SCALE_AREA;
+    gif->scale = 0;
+    gif->input.data = 0;
+    gif->input.size = 0;
+    gif->input.is_mapped = 0;
     dyn_arr_init(&gif->frames, 8, sizeof(struct frame));
+    dyn_arr_init(&gif->palettes, 8, sizeof(struct palette));
 }
 
-void gif_load_ct(struct gif *gif, uint8_t max_ct_color, struct frame *frame, FILE *file) {    
-    /* Load a global color table if frame is null, or a local color table otherwise */
+uint32_t gif_load_ct(struct gif *gif, uint8_t max_ct_color, const uint8_t *ct) {
+    /* Index in gif->palettes of the color table at ct, which holds
+       (max_ct_color + 1) * 3 bytes in the file. Tables already in the pool
+       are shared, so most GIFs end up with one or two */
 
-    uint8_t i, j;
-    uint16_t ct_bytes;
-    uint16_t ct_byte;
-    uint8_t *ct;
+    struct palette palette;
+    struct palette *pooled;
+    uint16_t colors = max_ct_color + 1;
+    uint16_t i;
+    size_t index;
 
-    ct_bytes = (max_ct_color + 1) * 3;
-    ct_byte = 0;
-    ct = (uint8_t *) malloc(ct_bytes);
-    fread(ct, 1, ct_bytes, file);
+    #if DEBUG_CT
+        printf("Color table:\n");
+        for (i = 0; i < colors; ++i) {
+            printf("    Row %d: %d %d %d\n", i, ct[i * 3], ct[i * 3 + 1], ct[i * 3 + 2]);
+        }
+    #endif
 
-    if (frame) {
-        frame->max_ct_color = max_ct_color;
-        #if DEBUG_CT
-            printf("Local color table:\n");
-        #endif
+    memset(palette.ct, 0, sizeof(palette.ct));
+    memcpy(palette.ct, ct, colors * 3);
+    palette.max_ct_color = max_ct_color;
+    palette.hash = GIF_HASH_OFFSET;
+    for (i = 0; i < colors * 3; ++i) {
+        palette.hash = (palette.hash ^ ct[i]) * GIF_HASH_PRIME;
     }
-    else {
-        gif->max_gct_color = max_ct_color;
-        #if DEBUG_CT
-            printf("Global color table:\n");
-        #endif
-    }
-
-    i = 0;
-    while (1) {
-        /* Loop for i = 0 to max_ct_color
-           max_ct_color can be 255, so need to be careful of overflow */
-
-        #if DEBUG_CT
-            printf("    Row %d: %d %d %d\n", 
-                i, ct[ct_byte], ct[ct_byte + 1], ct[ct_byte + 2]
-            );
-        #endif
 
-        for (j = 0; j < 3; ++j) {
-            if (frame) {
-                frame->ct[i][j] = ct[ct_byte];
-            }
-            else {
-                gif->gct[i][j] = ct[ct_byte];
-            }
-            ++ct_byte;
+    for (index = 0; index < gif->palettes.length; ++index) {
+        pooled = (struct palette *) dyn_arr_get(&gif->palettes, index);
+        if (pooled->hash == palette.hash &&
+            pooled->max_ct_color == max_ct_color &&
+            !memcmp(pooled->ct, palette.ct, colors * 3)) {
+            return index;
         }
+    }
 
-        if (i == max_ct_color) {
-            break;
-        }
-        ++i;
+    for (i = 0; i < 256; ++i) {
+        palette.grb[i][0] = palette.ct[i][1];
+        palette.grb[i][1] = palette.ct[i][0];
+        palette.grb[i][2] = palette.ct[i][2];
     }
+    palette.lut = 0;
+    dyn_arr_append(&gif->palettes, &palette);
 
-    free(ct);
+    return gif->palettes.length - 1;
 }
 
-void gif_init_code_table(struct dyn_arr *code_table, struct frame *frame) {
-    /* Initialize code table with GCT or LCT indices, clear code, EOI code */
+struct palette *gif_palette(struct gif *gif, struct frame *frame) {
+    return (struct palette *) dyn_arr_get(&gif->palettes, frame->palette);
+}
 
-    struct code_table_entry entry;
-    uint8_t i = 0;
+const uint8_t *gif_skip_sub_blocks(const uint8_t *pos, const uint8_t *end) {
+    /* Return the position just past a chain of data sub-blocks and its
+       terminator, or null if the chain runs past end */
 
-    while (1) {
-        entry.indices = (uint8_t *) malloc(1);
-        entry.length = 1;
-        entry.indices[0] = i;
-        dyn_arr_append(code_table, &entry);
+    uint8_t block_size;
 
-        if (i == frame->max_ct_color) {
-            break;
+    while (1) {
+        if (pos >= end) {
+            return 0;
         }
-
-        ++i;
+        block_size = *pos++;
+        if (!block_size) {
+            return pos;
+        }
+        if (end - pos < block_size) {
+            return 0;
+        }
+        pos += block_size;
     }
-
-    entry.indices = 0;
-    entry.length = 0;
-
-    dyn_arr_append(code_table, &entry);  /* Clear code */
-    dyn_arr_append(code_table, &entry);  /* EOI code */
 }
 
-void gif_free_code_table(struct dyn_arr *code_table) {
-    struct code_table_entry *entry;
-    uint16_t i;
+static inline uint64_t gif_load_word(const uint8_t *bytes) {
+    /* Unaligned little-endian 64-bit load */
+    uint64_t word;
 
-    for (i = 0; i < code_table->length; ++i) {
-        entry = (struct code_table_entry *) dyn_arr_get(code_table, i);
-        free(entry->indices);
-    }
-
-    dyn_arr_free(code_table);
+    memcpy(&word, bytes, sizeof(word));
+    #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+    #endif
+    return word;
 }
 
-uint8_t gif_increment_decode(
-    struct gif *gif,
-    uint16_t *frame_row,
-    uint16_t *frame_col,
-    uint32_t *index_counter
-) {
-    /* Increment decode counters, return 0 if at end */
-    ++(*index_counter);
-    ++(*frame_col);
-    if (*frame_col == gif->w) {
-        *frame_col = 0;
-        ++(*frame_row);
-        if (*frame_row == gif->h) {
-            *frame_row = 0;
-            return 0;
-        }
+static uint8_t gif_outside_index(struct gif *gif, struct frame *frame) {
+    /* Color of pixels outside the image rectangle */
+
+    if (frame->disposal == DISPOSAL_RETAIN && frame->has_transparency) {
+        return frame->transparent_index;
     }
-    return 1;
+    return gif->bg_index;
 }
 
-void gif_decode(
-    struct gif *gif,
+static void gif_decode_image(
     struct id *id,
-    struct frame *frame,
-    uint8_t *frame_codes, uint32_t code_bytes,
-    uint8_t min_code_size
+    const uint8_t *frame_codes, uint32_t code_bytes,
+    uint8_t min_code_size,
+    uint8_t fill_index,
+    uint8_t *pixels
 ) {
-    /* Decode LZW data */
+    /* Decode LZW data into pixels (size: img_w * img_h), pixels missing
+       from a short stream are set to fill_index
+       frame_codes is the chain of data sub-blocks as laid out in the file,
+       codes are read straight across sub-block boundaries
+       The code table is kept as prefix/suffix links, so adding a code is O(1)
+       and strings are written out back to front by following the links */
+
+    uint16_t prefix[LZW_MAX_CODES];
+    uint8_t suffix[LZW_MAX_CODES];
+    uint8_t first[LZW_MAX_CODES];  /* First index of each string */
+    uint16_t length[LZW_MAX_CODES];
+
+    uint16_t clear_code;
+    uint16_t eoi_code;
+    uint16_t next_code;
+    uint16_t code;
+    uint16_t prev_code = LZW_NO_CODE;
+    uint16_t string_code;
+    uint8_t code_size;
+    uint16_t i;
 
-    uint32_t i;
-    uint8_t j;
-    uint16_t k;
-    uint16_t code = 0;
-    uint16_t prev_code = 0;
-    uint16_t code_size = min_code_size + 1;
-    uint8_t code_bit_index = 0;
+    /* Bit reader state, refilled up to 8 bytes at a time */
+    const uint8_t *in = frame_codes;
+    const uint8_t *in_end = frame_codes + code_bytes;
+    uint8_t block_left = 0;  /* Bytes left in current sub-block */
+    uint64_t bit_buf = 0;
+    uint8_t bit_count = 0;
+    uint8_t refill_bytes;
+
+    /* Decoded indices in image descriptor order, written at pixel_index */
+    uint8_t *pixel;
+    uint32_t pixel_count = (uint32_t) id->img_w * id->img_h;
+    uint32_t pixel_index = 0;
+    uint16_t string_length;
+    uint8_t spill[LZW_MAX_CODES];  /* Holds a string running past the image end */
+
+    if (min_code_size < 2 || min_code_size > LZW_MAX_CODE_SIZE - 1) {
+        printf("Warning: Invalid LZW minimum code size %d\n", min_code_size);
+        goto gif_decode_fill;
+    }
 
-    /* Counters to track position on canvas */
-    uint16_t frame_row = 0;
-    uint16_t frame_col = 0;
-    uint32_t index_counter = 0;
+    clear_code = 1U << min_code_size;
+    eoi_code = clear_code + 1;
+    next_code = eoi_code + 1;
+    code_size = min_code_size + 1;
 
-    uint16_t outside_bounds_index;  /* Color of pixels outside frame */ 
+    for (i = 0; i < clear_code; ++i) {
+        prefix[i] = LZW_NO_CODE;
+        suffix[i] = (uint8_t) i;
+        first[i] = (uint8_t) i;
+        length[i] = 1;
+    }
+
+    while (pixel_index < pixel_count) {
+        if (bit_count < code_size) {
+            if (block_left >= 8 && in_end - in >= 8) {
+                /* Pull a whole word, keeping only the bytes that fit */
+                bit_buf |= gif_load_word(in) << bit_count;
+                refill_bytes = (63 - bit_count) >> 3;
+                in += refill_bytes;
+                block_left -= refill_bytes;
+                bit_count += refill_bytes * 8;
+            }
+            else {
+                /* Near a sub-block boundary, go a byte at a time */
+                while (bit_count <= 56 && in < in_end) {
+                    if (!block_left) {
+                        block_left = *in++;
+                        if (!block_left) {
+                            in = in_end;  /* Block terminator */
+                        }
+                        continue;
+                    }
+                    bit_buf |= ((uint64_t) *in++) << bit_count;
+                    bit_count += 8;
+                    --block_left;
+                }
+                if (bit_count < code_size) {
+                    break;  /* Out of data */
+                }
+            }
+        }
 
-    struct dyn_arr code_table;
-    struct code_table_entry *prev_entry;
-    struct code_table_entry *rd_entry;
-    struct code_table_entry wr_entry;
-    uint8_t has_read_init_code = 0;
+        code = bit_buf & ((1U << code_size) - 1);
+        bit_buf >>= code_size;
+        bit_count -= code_size;
 
-    dyn_arr_init(&code_table, 16, sizeof(struct code_table_entry));
-    frame->ct_indices = (uint8_t *) malloc(gif->w * gif->h);
+        if (code == clear_code) {
+            next_code = eoi_code + 1;
+            code_size = min_code_size + 1;
+            prev_code = LZW_NO_CODE;
+            continue;
+        }
+        if (code == eoi_code) {
+            break;
+        }
 
-    if (frame->disposal == DISPOSAL_RETAIN) {
-        if (frame->has_transparency) {
-            outside_bounds_index = frame->transparent_index;
+        if (prev_code == LZW_NO_CODE) {
+            /* First code after a clear must be a literal */
+            if (code >= clear_code) {
+                break;
+            }
+            string_code = code;
         }
         else {
-            outside_bounds_index = gif->bg_index;
-        }
-    }
-    else {
-        outside_bounds_index = gif->bg_index;
-    }
-
-    for (i = 0; i < code_bytes; ++i) {
-        for (j = 0; j < 8; ++j) {
-            /* Grab code_size bits from frame_codes one bit at a time */
-            code |= ((frame_codes[i] >> j) & 1U) << code_bit_index;
-            ++code_bit_index;
-            if (code_bit_index == code_size) {
-                /* Finished reading single code */
- 
-                if (code == ((uint16_t) frame->max_ct_color) + 1) {
-                    /* Clear code */
-                    gif_free_code_table(&code_table);
-                    gif_init_code_table(&code_table, frame);
-                    code_size = min_code_size + 1;
-                    has_read_init_code = 0;
-                }
-                else if (code == ((uint16_t) frame->max_ct_color) + 2) {
-                    /* EOI code */
-                }
-                else {
-                    if (code < code_table.length) {
-                        /* Code is in code table */
-                        rd_entry = (struct code_table_entry *) dyn_arr_get(&code_table, code);
-                    }
+            if (code > next_code) {
+                break;  /* Corrupt stream */
+            }
 
-                    if (has_read_init_code && code_table.length) {
-                        /* Only update code table if this is not the first code read */
-                        prev_entry = (struct code_table_entry *) dyn_arr_get(&code_table, prev_code);
-                        wr_entry.length = 1 + prev_entry->length; 
-                        wr_entry.indices = malloc(wr_entry.length);
-                        memcpy(wr_entry.indices, prev_entry->indices, prev_entry->length);
+            if (next_code < LZW_MAX_CODES) {
+                prefix[next_code] = prev_code;
+                suffix[next_code] = code == next_code ? first[prev_code] : first[code];
+                first[next_code] = first[prev_code];
+                length[next_code] = length[prev_code] + 1;
+                ++next_code;
 
-                        if (code_table.length == (1U << code_size) - 1 && code_size < 12) {
-                            ++code_size;
-                        }
+                if (next_code == (1U << code_size) && code_size < LZW_MAX_CODE_SIZE) {
+                    ++code_size;
+                }
+            }
+            string_code = code;
+        }
 
-                        if (code < code_table.length) {
-                            wr_entry.indices[prev_entry->length] = rd_entry->indices[0];
-                            dyn_arr_append(&code_table, &wr_entry);
+        /* Write string back to front by walking its prefix links */
+        string_length = length[string_code];
+        if (pixel_index + string_length <= pixel_count) {
+            pixel = pixels + pixel_index + string_length;
+            pixel_index += string_length;
+        }
+        else {
+            pixel = spill + string_length;
+        }
+        do {
+            *--pixel = suffix[string_code];
+            string_code = prefix[string_code];
+        } while (string_code != LZW_NO_CODE);
+
+        if (pixel == spill) {
+            memcpy(pixels + pixel_index, spill, pixel_count - pixel_index);
+            pixel_index = pixel_count;
+        }
 
-                            /* rd_entry may have been modified by realloc in dyn_arr_append */
-                            rd_entry = (struct code_table_entry *) dyn_arr_get(&code_table, code);
-                        }
-                        else {
-                            wr_entry.indices[prev_entry->length] = prev_entry->indices[0];
-                            rd_entry = (struct code_table_entry *) dyn_arr_append(&code_table, &wr_entry);
-                        }
-                    }
+        prev_code = code;
+    }
 
-                    /* Write to ct_indices */
-                    for (k = 0; k < rd_entry->length; ++k) {
-                        while (frame_row < id->img_top || frame_row >= id->img_top + id->img_h ||
-                            frame_col < id->img_left || frame_col >= id->img_left + id->img_w) {
-                            /* Outside bounds of frame on canvas */
+gif_decode_fill:
+    /* Pixels missing from a short stream take the out of bounds color */
+    memset(pixels + pixel_index, fill_index, pixel_count - pixel_index);
+}
 
-                            frame->ct_indices[index_counter] = outside_bounds_index;
+void gif_decode(
+    struct gif *gif,
+    struct id *id,
+    struct frame *frame,
+    const uint8_t *frame_codes, uint32_t code_bytes,
+    uint8_t min_code_size,
+    uint8_t *ct_indices
+) {
+    /* Decode LZW data into ct_indices (size: screen_w * screen_h), pixels
+       outside the image rectangle take the out of bounds color */
 
-                            if (!gif_increment_decode(gif, &frame_row, &frame_col, &index_counter)) {
-                                goto gif_decode_end;
-                            }
-                        }
-                        frame->ct_indices[index_counter] = rd_entry->indices[k];
-                        if (!gif_increment_decode(gif, &frame_row, &frame_col, &index_counter)) {
-                            goto gif_decode_end;
-                        }
-                    }
+    uint8_t *pixels;
+    uint32_t pixel_count = (uint32_t) id->img_w * id->img_h;
+    uint8_t is_full_canvas;
+    uint16_t row, rows, cols;
 
-                    prev_code = code;
-                    has_read_init_code = 1;
-                }
+    uint8_t outside_bounds_index = gif_outside_index(gif, frame);
+
+    /* Full canvas frames decode in place, others go through a scratch buffer */
+    is_full_canvas = id->img_left == 0 && id->img_top == 0 &&
+        id->img_w == gif->screen_w && id->img_h == gif->screen_h;
+    if (is_full_canvas) {
+        pixels = ct_indices;
+    }
+    else {
+        pixels = (uint8_t *) malloc(pixel_count ? pixel_count : 1);
+    }
 
-                code = 0;
-                code_bit_index = 0;
+    gif_decode_image(id, frame_codes, code_bytes, min_code_size, outside_bounds_index, pixels);
+
+    if (!is_full_canvas) {
+        memset(ct_indices, outside_bounds_index, gif->screen_w * gif->screen_h);
+
+        /* Place image rectangle on canvas, clipping anything outside it */
+        if (id->img_left < gif->screen_w && id->img_top < gif->screen_h) {
+            cols = gif->screen_w - id->img_left < id->img_w ? gif->screen_w - id->img_left : id->img_w;
+            rows = gif->screen_h - id->img_top < id->img_h ? gif->screen_h - id->img_top : id->img_h;
+            for (row = 0; row < rows; ++row) {
+                memcpy(
+                    ct_indices + (id->img_top + row) * gif->screen_w + id->img_left,
+                    pixels + row * id->img_w,
+                    cols
+                );
             }
         }
-    }
 
-    /* Remaining out of bounds indices */
-    while (index_counter < gif->w * gif->h) {
-        frame->ct_indices[index_counter] = outside_bounds_index;
-        ++index_counter;
+        free(pixels);
     }
+}
+
+void gif_decode_frame(struct gif *gif, struct frame *frame, uint8_t *ct_indices) {
+    /* Decode a frame from the compressed data found by gif_load_frame into
+       ct_indices (size: w * h), scaled to the floor if the logical screen
+       is another size */
+
+    uint8_t *screen = ct_indices;
+    struct palette *palette;
 
-gif_decode_end:
-    gif_free_code_table(&code_table);
+    if (gif->scale) {
+        screen = (uint8_t *) malloc(gif->screen_w * gif->screen_h);
+    }
+    gif_decode(
+        gif, &frame->id, frame,
+        frame->codes, frame->code_bytes,
+        frame->min_code_size,
+        screen
+    );
+    if (gif->scale) {
+        palette = gif_palette(gif, frame);
+        scale_frame(
+            gif->scale,
+            palette->ct[0], palette->max_ct_color,
+            frame->has_transparency, frame->transparent_index,
+            gif_outside_index(gif, frame),
+            screen, ct_indices
+        );
+        free(screen);
+    }
 }
 
-int gif_load_frame(struct gif *gif, struct gce *gce, uint8_t *buffer, FILE *file) { 
+int gif_load_frame(struct gif *gif, struct gce *gce, const uint8_t **pos, const uint8_t *end) { 
     /* Load frame with (optional) GCE data
-       Buffer must be able to contain at least 9 bytes */
-
-    uint8_t i, j;
+       pos points just past the image separator and is advanced past the frame */
 
     struct id id;
+    const uint8_t *buffer = *pos;
 
-    uint8_t *frame_codes = 0;
-    uint32_t code_bytes = 0;
+    const uint8_t *frame_codes;
+    const uint8_t *codes_end;
     uint8_t min_code_size;
 
     struct frame new_frame;
     struct frame *frame = (struct frame *) dyn_arr_append(&gif->frames, &new_frame);
     uint8_t frame_has_lct;
+    uint16_t lct_bytes;
+
+    frame->ct_indices = 0;
+    frame->source = gif->frames.length - 1;
+    frame->data = 0;
+    frame->codes = 0;
 
     /* Graphic control extension */
     if (gce) {
@@ -285,7 +389,10 @@ int gif_load_frame(struct gif *gif, struct gce *gce, uint8_t *buffer, FILE *file
     }
 
     /* Image desriptor */
-    fread(buffer, 1, 9, file);
+    if (end - buffer < 9) {
+        printf("Error: Unexpected end of GIF data\n");
+        return ERROR_OUT;
+    }
     id.img_left = combine_bytes(buffer[0], buffer[1]);
     id.img_top = combine_bytes(buffer[2], buffer[3]);
     id.img_w = combine_bytes(buffer[4], buffer[5]);
@@ -310,83 +417,323 @@ int gif_load_frame(struct gif *gif, struct gce *gce, uint8_t *buffer, FILE *file
 
     /* Local color table */
     if (frame_has_lct) {
-        gif_load_ct(gif, (1U << ((buffer[8] & 7U) + 1)) - 1, frame, file);
+        lct_bytes = (1U << ((buffer[8] & 7U) + 1)) * 3;
+        if (end - buffer < 9 + lct_bytes) {
+            printf("Error: Unexpected end of GIF data\n");
+            return ERROR_OUT;
+        }
+        frame->palette = gif_load_ct(gif, (1U << ((buffer[8] & 7U) + 1)) - 1, buffer + 9);
+        buffer += 9 + lct_bytes;
     }
     else { 
         if (!gif->has_gct) {
             printf("Error: Frame has no global or local color table\n");
             return ERROR_OUT;
         }
+        frame->palette = gif->gct;
+        buffer += 9;
+    }
 
-        frame->max_ct_color = gif->max_gct_color;
+    /* Image data, sub-blocks are left in place and decoded from there */
+    if (buffer >= end) {
+        printf("Error: Unexpected end of GIF data\n");
+        return ERROR_OUT;
+    }
+    min_code_size = *buffer++;
+    frame_codes = buffer;
+    if (!(codes_end = gif_skip_sub_blocks(frame_codes, end))) {
+        printf("Error: Unexpected end of GIF data\n");
+        return ERROR_OUT;
+    }
+    *pos = codes_end;
+
+    frame->id = id;
+    frame->min_code_size = min_code_size;
+
+    /* Pixels outside the image rectangle repaint the canvas unless they are
+       transparent. Scaled frames are cropped once decoded instead */
+    frame->rect.left = 0;
+    frame->rect.top = 0;
+    frame->rect.w = gif->w;
+    frame->rect.h = gif->h;
+    if (!gif->scale && frame->has_transparency && gif_outside_index(gif, frame) == frame->transparent_index) {
+        frame->rect.left = id.img_left < gif->w ? id.img_left : gif->w;
+        frame->rect.top = id.img_top < gif->h ? id.img_top : gif->h;
+        frame->rect.w = gif->w - frame->rect.left < id.img_w ? gif->w - frame->rect.left : id.img_w;
+        frame->rect.h = gif->h - frame->rect.top < id.img_h ? gif->h - frame->rect.top : id.img_h;
+    }
+    frame->codes = frame_codes;
+    frame->code_bytes = codes_end - frame_codes;
 
-        /* Copy GCT into frame CT data */
-        i = 0;
-        while (1) {
-            for (j = 0; j < 3; ++j) {
-                frame->ct[i][j] = gif->gct[i][j];
-            }
-            if (i == frame->max_ct_color) {
-                break;
+    /* Frame is decoded from the file mapping later, by gif_decode_all or
+       on demand with lazy_decode set */
+    return SUCC_OUT;
+}
+
+static void gif_crop_frame(struct frame *frame, uint16_t stride) {
+    /* Shrink frame->rect to the bounding box of its non-transparent pixels
+       and pack ct_indices, which holds the rows of frame->rect stride apart */
+
+    uint8_t *ct_indices = frame->ct_indices;
+    uint16_t top = 0;
+    uint16_t bottom = frame->rect.h;
+    uint16_t left = 0;
+    uint16_t right = frame->rect.w;
+    uint16_t row, col;
+    size_t pixels;
+
+    if (frame->has_transparency) {
+        top = frame->rect.h;
+        bottom = 0;
+        left = frame->rect.w;
+        right = 0;
+        for (row = 0; row < frame->rect.h; ++row) {
+            for (col = 0; col < frame->rect.w; ++col) {
+                if (ct_indices[row * stride + col] != frame->transparent_index) {
+                    top = row < top ? row : top;
+                    bottom = row + 1;
+                    left = col < left ? col : left;
+                    right = col + 1 > right ? col + 1 : right;
+                }
             }
-            ++i;
+        }
+        if (bottom <= top) {
+            /* Fully transparent, the frame changes nothing */
+            top = bottom = left = right = 0;
         }
     }
 
-    /* Image data */
-    fread(buffer, 1, 1, file);
-    min_code_size = buffer[0];
-    while (1) {
-        fread(buffer, 1, 1, file);
-        if (!buffer[0]) {
-            break;
+    for (row = top; row < bottom; ++row) {
+        memmove(ct_indices + (row - top) * (right - left), ct_indices + row * stride + left, right - left);
+    }
+    frame->rect.left += left;
+    frame->rect.top += top;
+    frame->rect.w = right - left;
+    frame->rect.h = bottom - top;
+    pixels = (size_t) frame->rect.w * frame->rect.h;
+    frame->ct_indices = (uint8_t *) realloc(ct_indices, pixels ? pixels : 1);
+}
+
+struct gif_decoder {
+    struct gif *gif;
+    size_t next;  /* Next frame to claim */
+};
+
+static void *gif_decode_worker(void *arg) {
+    /* Decode frames until none are left. Frames only depend on their own
+       compressed data, so workers never wait on each other */
+
+    struct gif_decoder *decoder = (struct gif_decoder *) arg;
+    struct gif *gif = decoder->gif;
+    struct frame *frame;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&decoder->next, 1, __ATOMIC_RELAXED)) < gif->frames.length) {
+        frame = (struct frame *) dyn_arr_get(&gif->frames, i);
+
+        #if DEBUG
+            printf("Decoding frame %ld (min code size: %d)...\n", i, frame->min_code_size);
+        #endif
+
+        /* Frames covering the canvas are placed on it, the rest are decoded
+           as their image rectangle alone, of which rect is the top left */
+        if (frame->rect.w == gif->w && frame->rect.h == gif->h) {
+            gif_decode_frame(gif, frame, frame->ct_indices);
+            gif_crop_frame(frame, gif->w);
+        }
+        else {
+            gif_decode_image(
+                &frame->id, frame->codes, frame->code_bytes, frame->min_code_size,
+                gif_outside_index(gif, frame), frame->ct_indices
+            );
+            gif_crop_frame(frame, frame->id.img_w);
+        }
+        frame->codes = 0;
+    }
+
+    return 0;
+}
+
+static void gif_decode_all(struct gif *gif) {
+    /* Decode every scanned frame, spread over a pool of threads */
+
+    struct gif_decoder decoder;
+    struct frame *frame;
+    pthread_t threads[GIF_DECODE_THREADS_MAX];
+    long thread_count = gif->decode_threads;
+    long started;
+    size_t i;
+    size_t pixels;
+
+    decoder.gif = gif;
+    decoder.next = 0;
+
+    /* Allocate up front, dyn_arr_get is then the only access workers share */
+    for (i = 0; i < gif->frames.length; ++i) {
+        frame = (struct frame *) dyn_arr_get(&gif->frames, i);
+        if (frame->rect.w == gif->w && frame->rect.h == gif->h) {
+            pixels = gif->w * gif->h;
+        }
+        else {
+            pixels = (size_t) frame->id.img_w * frame->id.img_h;
         }
+        frame->ct_indices = (uint8_t *) malloc(pixels ? pixels : 1);
+    }
 
-        code_bytes += buffer[0];
-        frame_codes = (uint8_t *) realloc(frame_codes, code_bytes);
-        fread(frame_codes + code_bytes - buffer[0], 1, buffer[0], file);
+    if (!thread_count) {
+        thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (thread_count > GIF_DECODE_THREADS_MAX) {
+        thread_count = GIF_DECODE_THREADS_MAX;
+    }
+    if ((size_t) thread_count > gif->frames.length) {
+        thread_count = gif->frames.length;
+    }
+
+    /* The calling thread decodes as well, so one fewer is started */
+    for (started = 0; started < thread_count - 1; ++started) {
+        if (pthread_create(&threads[started], 0, gif_decode_worker, &decoder) != 0) {
+            /* Whatever threads did start, and this one, finish the work */
+            perror("Error [pthread_create]");
+            break;
+        }
+    }
+    gif_decode_worker(&decoder);
+    while (started > 0) {
+        pthread_join(threads[--started], 0);
     }
 
     #if DEBUG
-        printf("Decoding frame %ld (min code size: %d)...\n", gif->frames.length, min_code_size);
+        printf("Decoded %ld frames on %ld threads\n", gif->frames.length, thread_count);
     #endif
-    
-    gif_decode(gif, &id, frame, frame_codes, code_bytes, min_code_size);
-    free(frame_codes);
+}
+
+static uint64_t gif_hash_frame(struct frame *frame) {
+    /* FNV-1a over everything that decides how a frame is composited */
+
+    uint64_t hash = GIF_HASH_OFFSET;
+    uint32_t i;
+    uint32_t pixels = frame->rect.w * frame->rect.h;
+
+    hash = (hash ^ frame->rect.left) * GIF_HASH_PRIME;
+    hash = (hash ^ frame->rect.top) * GIF_HASH_PRIME;
+    hash = (hash ^ frame->rect.w) * GIF_HASH_PRIME;
+    hash = (hash ^ frame->rect.h) * GIF_HASH_PRIME;
+    for (i = 0; i < pixels; ++i) {
+        hash = (hash ^ frame->ct_indices[i]) * GIF_HASH_PRIME;
+    }
+    hash = (hash ^ frame->palette) * GIF_HASH_PRIME;
+    hash = (hash ^ frame->has_transparency) * GIF_HASH_PRIME;
+    hash = (hash ^ frame->transparent_index) * GIF_HASH_PRIME;
+
+    return hash;
+}
+
+static uint8_t gif_frames_equal(struct frame *a, struct frame *b) {
+    return !memcmp(&a->rect, &b->rect, sizeof(struct rect)) &&
+        a->palette == b->palette &&
+        a->has_transparency == b->has_transparency &&
+        a->transparent_index == b->transparent_index &&
+        !memcmp(a->ct_indices, b->ct_indices, a->rect.w * a->rect.h);
+}
+
+static void gif_dedupe(struct gif *gif) {
+    /* Merge runs of identical frames into one frame with their summed delay,
+       and make later repeats of a frame share its ct_indices. Compositing a
+       frame onto itself changes nothing, so merging runs is exact */
+
+    size_t i, j;
+    size_t length = 0;  /* Frames kept so far */
+    uint64_t *hashes = (uint64_t *) malloc(gif->frames.length * sizeof(uint64_t));
+    struct frame *frame;
+    struct frame *kept;
+
+    for (i = 0; i < gif->frames.length; ++i) {
+        frame = (struct frame *) dyn_arr_get(&gif->frames, i);
+        hashes[length] = gif_hash_frame(frame);
+
+        if (length) {
+            kept = (struct frame *) dyn_arr_get(&gif->frames, length - 1);
+            if (hashes[length] == hashes[length - 1] &&
+                kept->delay + frame->delay <= UINT16_MAX &&
+                gif_frames_equal(kept, frame)) {
+                kept->delay += frame->delay;
+                free(frame->ct_indices);
+                continue;
+            }
+        }
+
+        kept = (struct frame *) dyn_arr_get(&gif->frames, length);
+        if (kept != frame) {
+            memcpy(kept, frame, sizeof(struct frame));
+        }
+        kept->source = length;
+
+        for (j = 0; j < length; ++j) {
+            if (hashes[j] == hashes[length]) {
+                frame = (struct frame *) dyn_arr_get(&gif->frames, j);
+                if (frame->source == j && gif_frames_equal(frame, kept)) {
+                    free(kept->ct_indices);
+                    kept->ct_indices = frame->ct_indices;
+                    kept->source = j;
+                    break;
+                }
+            }
+        }
+
+        ++length;
+    }
 
     #if DEBUG
-        printf("Finished loading frame %ld\n", gif->frames.length);
+        printf("Merged %ld duplicate frames\n", gif->frames.length - length);
     #endif
 
-    return SUCC_OUT;
+    gif->frames.length = length;
+    dyn_arr_squeeze(&gif->frames);
+    dyn_arr_squeeze(&gif->palettes);
+    free(hashes);
 }
 
 int gif_load(struct gif *gif, const char *filename) {
-    FILE *file;
-    uint8_t buffer[9];
+    /* Load gif from filename. On failure everything loaded so far is
+       freed, gif_free need not be called */
+
+    const uint8_t *buffer;
+    const uint8_t *end;
 
     struct gce gce;
     uint8_t frame_has_gce = 0;
+    uint8_t block_size;
 
-    file = fopen(filename, "rb");
+    if (file_map_open(&gif->input, filename) == ERROR_OUT) {
+        goto error;
+    }
+    buffer = gif->input.data;
+    end = gif->input.data + gif->input.size;
 
     /* Verify header signature */
-    fread(buffer, 1, 3, file);
-    if (!(buffer[0] == 'G' && buffer[1] == 'I' && buffer[2] == 'F')) {
+    if (end - buffer < 13 || !(buffer[0] == 'G' && buffer[1] == 'I' && buffer[2] == 'F')) {
         printf("Error: Invalid GIF file signature\n");
-        return ERROR_OUT;
+        goto error;
     }
 
-    fseek(file, 3, SEEK_CUR);  /* Skip version */
+    buffer += 6;  /* Skip signature and version */
     
     /* Logical screen descriptor */
-    fread(buffer, 1, 7, file);
-    
-    gif->w = combine_bytes(buffer[0], buffer[1]);
-    gif->h = combine_bytes(buffer[2], buffer[3]);
+    gif->screen_w = combine_bytes(buffer[0], buffer[1]);
+    gif->screen_h = combine_bytes(buffer[2], buffer[3]);
+    gif->w = gif->screen_w;
+    gif->h = gif->screen_h;
     if (gif->w != LED_COLS || gif->h != LED_ROWS) {
-        printf("Error: Invalid GIF dimensions\n");
-        return ERROR_OUT;
+        /* Frames are resampled to the floor as they are decoded */
+        gif->scale = (struct scale *) malloc(sizeof(struct scale));
+        if (scale_init(gif->scale, gif->screen_w, gif->screen_h, LED_COLS, LED_ROWS, &gif->scaling) == ERROR_OUT) {
+            free(gif->scale);
+            gif->scale = 0;
+            goto error;
+        }
+        gif->w = LED_COLS;
+        gif->h = LED_ROWS;
     }
 
     gif->has_gct = (buffer[4] >> 7) & 1U;
@@ -394,8 +741,8 @@ int gif_load(struct gif *gif, const char *filename) {
 
     #if DEBUG
         printf("Logical screen descriptor:\n");
-        printf("    Canvas width: %d\n", gif->w);
-        printf("    Canvas height: %d\n", gif->h);
+        printf("    Canvas width: %d\n", gif->screen_w);
+        printf("    Canvas height: %d\n", gif->screen_h);
         printf("    GCT flag: %d\n", gif->has_gct);
         printf("    Color resolution: %d\n", (buffer[4] >> 4) & 7U);
         printf("    Sort flag: %d\n", (buffer[4] >> 3) & 1U);
@@ -405,25 +752,35 @@ int gif_load(struct gif *gif, const char *filename) {
     #endif
 
     if (gif->has_gct) {
-        gif_load_ct(gif, (1U << ((buffer[4] & 7U) + 1)) - 1, 0, file);
+        if (end - buffer < 7 + (1 << ((buffer[4] & 7U) + 1)) * 3) {
+            printf("Error: Unexpected end of GIF data\n");
+            goto error;
+        }
+        gif->gct = gif_load_ct(gif, (1U << ((buffer[4] & 7U) + 1)) - 1, buffer + 7);
+        buffer += (1 << ((buffer[4] & 7U) + 1)) * 3;
     }
+    buffer += 7;
 
-    while (1) {
-        if (!fread(buffer, 1, 1, file)) {
-            break;
-        }
+    while (buffer < end) {
         if (buffer[0] == 0x21) {
             /* Extension block */
-            fread(buffer, 1, 1, file);  /* Get extension label */
-            if (buffer[0] == 0xF9) {
+            if (end - buffer < 3) {
+                printf("Error: Unexpected end of GIF data\n");
+                goto error;
+            }
+            if (buffer[1] == 0xF9) {
                 /* Graphic control extension */
 
                 #if DEBUG
                     printf("Graphic control extension:\n");
                 #endif
 
-                fread(buffer, 1, 1, file);  /* Get block size */
-                fread(buffer, 1, buffer[0] + 1, file);  /* Get block data */
+                block_size = buffer[2];  /* Get block size */
+                buffer += 3;  /* Get block data */
+                if (block_size < 4 || end - buffer < block_size) {
+                    printf("Error: Invalid graphic control extension\n");
+                    goto error;
+                }
                 gce.has_transparency = buffer[0] & 1U;
                 gce.disposal = (buffer[0] >> 2) & 7U;
                 if (gce.disposal == DISPOSAL_PREV) {
@@ -444,27 +801,26 @@ int gif_load(struct gif *gif, const char *filename) {
                 #endif
 
                 frame_has_gce = 1;
+                buffer += block_size;
             }
             else {
                 /* Any other extension */
-                printf("Warning: Skipping extension with label 0x%X\n", buffer[0]);
-                
-                /* Skip all data sub-blocks */
-                while (1) {
-                    fread(buffer, 1, 1, file);
-                    if (!buffer[0]) {
-                        break;
-                    }
-                    fseek(file, buffer[0], SEEK_CUR);
-                }
-
+                printf("Warning: Skipping extension with label 0x%X\n", buffer[1]);
+                buffer += 2;
                 frame_has_gce = 0;
             }
+
+            /* Skip all (remaining) data sub-blocks */
+            if (!(buffer = gif_skip_sub_blocks(buffer, end))) {
+                printf("Error: Unexpected end of GIF data\n");
+                goto error;
+            }
         }
         else if (buffer[0] == 0x2C) {
             /* Image descriptor reached, load a full frame */
-            if (gif_load_frame(gif, frame_has_gce ? &gce : 0, buffer, file) == ERROR_OUT) {
-                return ERROR_OUT;
+            ++buffer;
+            if (gif_load_frame(gif, frame_has_gce ? &gce : 0, &buffer, end) == ERROR_OUT) {
+                goto error;
             }
             frame_has_gce = 0;
         }
@@ -474,19 +830,29 @@ int gif_load(struct gif *gif, const char *filename) {
         }
         else {
             printf("Error: Unknown block start byte 0x%X\n", buffer[0]);
-            return ERROR_OUT;
+            goto error;
         }
     }
 
     dyn_arr_squeeze(&gif->frames);
+    dyn_arr_squeeze(&gif->palettes);
 
     #if DEBUG
         printf("Loaded %ld frames\n", gif->frames.length);
     #endif
 
-    fclose(file);
+    if (!gif->lazy_decode) {
+        /* Every frame is decoded, compressed data is no longer needed */
+        gif_decode_all(gif);
+        file_map_close(&gif->input);
+        gif_dedupe(gif);
+    }
 
     return SUCC_OUT;
+
+error:
+    gif_free(gif);
+    return ERROR_OUT;
 }
 
 void gif_free(struct gif *gif) {
@@ -495,9 +861,21 @@ void gif_free(struct gif *gif) {
 
     for (i = 0; i < gif->frames.length; ++i) {
         frame = (struct frame *) dyn_arr_get(&gif->frames, i);
+        if (frame->source != i) {
+            /* Shared with an earlier frame */
+            continue;
+        }
         free(frame->ct_indices);
+        free(frame->data);
     }
 
     dyn_arr_free(&gif->frames);
+    dyn_arr_free(&gif->palettes);
+    file_map_close(&gif->input);
+    if (gif->scale) {
+        scale_free(gif->scale);
+        free(gif->scale);
+        gif->scale = 0;
+    }
 }
 
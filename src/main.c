@@ -1,160 +1,58 @@
-#include <arpa/inet.h>
-#include <linux/if_packet.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <sys/ioctl.h>
-#include <sys/socket.h>
-#include <net/if.h>
-#include <netinet/ether.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <termios.h>
-#include <sys/time.h>
 #include <math.h>
 #include <pthread.h>
 
 #include "global_defines.h"
 #include "gif.h"
+#include "stream.h"
+#include "packet.h"
+#include "tx.h"
+#include "timing.h"
+#include "render.h"
+#include "color.h"
+#include "control.h"
+#include "frame_store.h"
+#include "compose.h"
+#include "show.h"
+#include "playlist.h"
+#include "stats.h"
 
 #define DO_ETH 1
 #define INTERFACE_NAME "enp2s0"
-#define SER_NAME "/dev/ttyACM0"
-#define CHUNKS 27
-#define LED_CHANNELS 3
-#define LED_BITS 24  /* LED_CHANNELS*8 */
-#define CHUNK_ROWS 8
-#define CHUNK_COLS 55
-#define LED_INDEX_BYTES 2
-#define DATA_BYTES 81  /* CHUNKS*LED_CHANNELS */
-#define CHUNK_LEDS 440  /* CHUNK_ROWS*CHUNK_COLS */
-#define HEADER_BYTES 14  /* sizeof(struct ether_header) = 6+6+2 */
-#define FRAME_BYTES 97  /* HEADER_BYTES+LED_INDEX_BYTES+DATA_BYTES */
-#define MAX_BRIGHTNESS 0.05
-
-uint8_t frame_buffer[FRAME_BYTES];  /* One Ethernet frame contains data for one LED per chunk  */
-uint8_t color_frame[LED_ROWS][LED_COLS][LED_CHANNELS];  /* Colors for full dance floor */
-uint8_t color_frame_adj[LED_ROWS][LED_COLS][LED_CHANNELS];  /* Colors with adjusted brightness */
-double brightness = 0;
-
-void color_frame_to_eth(uint16_t led_index) {
-    /* 
-     * Fill frame_buffer with color_frame data at given led_index
-     * color_frame format: GRB, GRB, GRB, ... for each row and column of LEDs
-     * frame_buffer format: G bit 1, chunk 1; G bit 1, chunk 2; ...; B bit 8,i chunk 27
-     */
-
-    uint8_t chunk_led_row = led_index / CHUNK_COLS;
-    uint8_t chunk_led_col = led_index % CHUNK_COLS;
-
-    /* led_row and led_col are chunk indices above but with chunk offsets applied */
-    uint8_t led_row = 0;
-    uint8_t led_col = 0;
-
-    uint8_t i, j, k, l;
-    uint16_t frame_buffer_bit_index = 8 * (HEADER_BYTES + LED_INDEX_BYTES);
-
-    memset(frame_buffer + HEADER_BYTES + LED_INDEX_BYTES, 0, DATA_BYTES);
-
-    /* LEDs snake between rows */
-    if (chunk_led_row % 2 == 0) {
-        chunk_led_col = CHUNK_COLS - chunk_led_col;
-    }
-
-    for (i = 0; i < LED_CHANNELS; ++i) {
-        /* For each bit of the current channel */
-        for (j = 0; j < 8; ++j) {
-            /* For each row of chunks */
-            for (k = 0; k < 9; ++k) {
-                led_row = chunk_led_row + k * CHUNK_ROWS;
-                /* For each column of chunks */
-                for (l = 0; l < 3; ++l) {
-                    led_col = chunk_led_col + l * CHUNK_COLS;
-
-                    /* Select bit j from color_frame, place in chunk_index bit of current_bits */
-                    frame_buffer[frame_buffer_bit_index / 8] |= (
-                        ((color_frame_adj[led_row][led_col][i] >> (7 - j)) & 1U) <<
-                        frame_buffer_bit_index % 8
-                    );
-
-                    ++frame_buffer_bit_index;
-                }
-            }
-        }
-    }
-}
 
-double get_millis(struct timeval *tv) {
-    gettimeofday(tv, 0);
-    return tv->tv_sec * 1000 + tv->tv_usec / 1000.0; 
-}
-
-void load_gif_frame(struct frame *frame) {
-    /* Copy frame data into color_frame */
-    
-    uint8_t i, j;
-    uint16_t pixel_counter = 0;
-    uint8_t ct_index;
-
-    for (i = 0; i < LED_ROWS; ++i) {
-        for (j = 0; j < LED_COLS; ++j) {
-            ct_index = frame->ct_indices[pixel_counter++];
-        
-            if (!frame->has_transparency || ct_index != frame->transparent_index) {
-                /* Transparent pixel retains same color */
-                color_frame[i][j][0] = frame->ct[ct_index][1];
-                color_frame[i][j][1] = frame->ct[ct_index][0];
-                color_frame[i][j][2] = frame->ct[ct_index][2];
-            }
+struct color_frame color_frame;
+struct color_table colors;  /* Brightness level set by the control thread */
 
-            color_frame_adj[i][j][0] = color_frame[i][j][0] * brightness;//0
-            color_frame_adj[i][j][1] = color_frame[i][j][1] * brightness;//20
-            color_frame_adj[i][j][2] = color_frame[i][j][2] * brightness;//0
-        }
-    }
-}
+/* Playback state, owned by the render thread once it is started */
+struct player {
+    struct gif gif;
+    struct gif_stream stream;
+    uint8_t do_stream;
 
-int prep_gif(struct gif *gif, const char *filename) {
-    /* Load GIF and copy first frame data into color_frame */
+    struct show show;
+    uint8_t is_show;  /* Playing a compiled show instead of gif */
+    struct color_table show_levels;  /* Each level's brightness relative to the show's */
 
-    uint8_t i, j;
-    uint16_t pixel_counter = 0;
-    uint8_t ct_index;
-    struct frame *frame;
-    uint8_t bg_r, bg_g, bg_b;
+    struct packet_cache cache;
+    uint8_t do_cache;
+    uint8_t is_cached;  /* Whether cache is in use for the current GIF */
+    uint8_t is_cache_armed;
+    const uint8_t *header;
 
-    if (gif_load(gif, filename) == ERROR_OUT) {
-        return ERROR_OUT;
-    }
+    struct playlist *playlist;  /* Null when playing a single GIF */
+    uint32_t loops;  /* Times the current GIF has been played through */
 
-    frame = (struct frame *) dyn_arr_get(&(gif->frames), 0);
+    struct compositor compositor;  /* Transitions and layers over the GIF */
 
-    bg_r = frame->ct[gif->bg_index][0];
-    bg_g = frame->ct[gif->bg_index][1];
-    bg_b = frame->ct[gif->bg_index][2];
-
-    for (i = 0; i < LED_ROWS; ++i) {
-        for (j = 0; j < LED_COLS; ++j) {
-            ct_index = frame->ct_indices[pixel_counter++];
-            if (frame->has_transparency && ct_index == frame->transparent_index) {
-                /* Transparent pixel set to bg color */
-                color_frame[i][j][0] = bg_g;
-                color_frame[i][j][1] = bg_r;
-                color_frame[i][j][2] = bg_b;
-            }
-            else {
-                color_frame[i][j][0] = frame->ct[ct_index][1];
-                color_frame[i][j][1] = frame->ct[ct_index][0];
-                color_frame[i][j][2] = frame->ct[ct_index][2];
-            }
-            color_frame_adj[i][j][0] = color_frame[i][j][0] * brightness;
-            color_frame_adj[i][j][1] = color_frame[i][j][1] * brightness;
-            color_frame_adj[i][j][2] = color_frame[i][j][2] * brightness;
-        }
-    }
-
-    return SUCC_OUT;
-}
+    uint16_t frame_index;
+    uint8_t *canvas;  /* ct_indices of the current frame, expanded from the frame store */
+    struct frame_clock clock;
+    struct render_buffer render;  /* One Ethernet frame per LED index, each with data for one LED per chunk */
+    struct control *control;
+};
 
 void print_color_frame() {
     uint8_t i, j;
@@ -165,9 +63,9 @@ void print_color_frame() {
     for (i = 0; i < LED_ROWS; ++i) {
         printf("    ");
         for (j = 0; j < LED_COLS; ++j) {
-            g = color_frame[i][j][0];
-            r = color_frame[i][j][1];
-            b = color_frame[i][j][2];
+            g = color_frame.colors[i][j][0];
+            r = color_frame.colors[i][j][1];
+            b = color_frame.colors[i][j][2];
             formatted_color = (((uint32_t) r) << 16);
             formatted_color |= (((uint32_t) g) << 8);
             formatted_color |= (uint32_t) b;
@@ -177,202 +75,678 @@ void print_color_frame() {
     }
 }
 
-int get_ser_fd(int *fd) {
-    struct termios tty;
+uint8_t player_wait_taken(struct player *player) {
+    /* Wait until the transmit thread has taken the last published refresh.
+       Return 0 if shutting down instead */
 
-    if ((*fd = open(SER_NAME, O_RDONLY | O_NOCTTY | O_SYNC)) < 0) {
-        perror("Error [open serial]");
-        return ERROR_OUT;
+    while (render_buffer_is_pending(&player->render)) {
+        if (control_is_stopped(player->control)) {
+            return 0;
+        }
+        time_wait_until(time_now_ns() + RENDER_POLL_NS, 0);
     }
 
-    if (tcgetattr(*fd, &tty) != 0) {
-        perror("Error [tcgetattr]");
-        return ERROR_OUT;
+    return 1;
+}
+
+size_t player_length(struct player *player) {
+    return player->is_show ? player->show.header->frame_count : player->gif.frames.length;
+}
+
+uint16_t player_delay(struct player *player, size_t index) {
+    if (player->is_show) {
+        return player->show.frames[index].delay;
     }
+    return ((struct frame *) dyn_arr_get(&(player->gif.frames), index))->delay;
+}
 
-    cfsetispeed(&tty, B9600);
-    
-    tty.c_cflag = (tty.c_cflag & ~CSIZE) | CS8;
-    tty.c_cflag |= (CLOCAL | CREAD);
-    tty.c_cflag &= ~(PARENB | PARODD);
-    tty.c_cflag &= ~CSTOPB;
-    tty.c_cflag &= ~CRTSCTS;
+const uint8_t *player_expand(struct player *player, size_t index, uint16_t *stride) {
+    /* ct_indices of the rect of frame index, rows stride apart. Streamed
+       frames are decoded onto the whole canvas */
 
-    tty.c_iflag &= ~IGNBRK;
-    tty.c_iflag &= ~(IXON | IXOFF | IXANY);
+    struct frame *frame = (struct frame *) dyn_arr_get(&(player->gif.frames), index);
 
-    tty.c_lflag = 0;
+    if (player->do_stream) {
+        *stride = player->gif.w;
+        return gif_stream_next(&player->stream, 0) + frame->rect.top * player->gif.w + frame->rect.left;
+    }
+    *stride = frame->rect.w;
+    return frame_store_expand(&player->gif, index, player->canvas);
+}
 
-    tty.c_cc[VMIN] = 0;
-    tty.c_cc[VTIME] = 5;
+void player_fill_show(struct player *player, struct packet_set *packets) {
+    /* Fill packets with the current show frame. Unless the brightness level
+       is the one the show was compiled at, payloads are unpacked, scaled and
+       packetized again. color_frame is free to use while a show plays */
 
-    if (tcsetattr(*fd, TCSANOW, &tty) != 0) {
-        perror("Error [tcsetattr]");
-        return ERROR_OUT;
+    const struct color_lut *lut = &player->show_levels.luts[color_table_level(&colors, color_table_get(&colors))];
+    uint8_t *pixels = &color_frame.adjusted[0][0][0];
+    uint16_t i;
+    uint32_t j;
+
+    show_fill(&player->show, player->frame_index, packets);
+    if (color_lut_is_identity(lut)) {
+        return;
     }
 
-    return SUCC_OUT;
+    for (i = 0; i < CHUNK_LEDS; ++i) {
+        eth_to_color_frame(color_frame.adjusted, packets->packets[i]);
+    }
+    for (j = 0; j < LED_ROWS * LED_COLS * LED_CHANNELS; j += LED_CHANNELS) {
+        pixels[j] = lut->ch[0][pixels[j]];
+        pixels[j + 1] = lut->ch[1][pixels[j + 1]];
+        pixels[j + 2] = lut->ch[2][pixels[j + 2]];
+    }
+    packet_set_render(packets, color_frame.adjusted);
 }
 
-void update_brightness(int ser_fd) {
-    char rd_char;
-    int rd_size = read(ser_fd, &rd_char, 1);
-    if (rd_size == 0) {
-        return;
+struct packet_set *player_render(struct player *player) {
+    /* Packetize color_frame into the back buffer, as far as it changed */
+
+    render_buffer_invalidate(&player->render, &color_frame.dirty);
+    color_frame.dirty.w = 0;
+    color_frame.dirty.h = 0;
+
+    return render_buffer_render(&player->render, color_frame.adjusted);
+}
+
+int player_start(struct player *player, const struct color_lut *lut) {
+    /* Publish the first frame of player->gif (or show) and start its frame clock */
+
+    struct frame *first_frame;
+    const uint8_t *ct_indices;
+    uint16_t stride;
+    struct packet_set *packets;
+
+    player->frame_index = 0;
+    player->loops = 0;
+
+    if (player->is_show) {
+        player->is_cached = 0;
+        packets = render_buffer_back(&player->render);
+        player_fill_show(player, packets);
+        render_buffer_publish(&player->render, packets);
+        frame_clock_start(&player->clock, time_now_ns(), player_delay(player, 0));
+        return SUCC_OUT;
+    }
+
+    first_frame = (struct frame *) dyn_arr_get(&(player->gif.frames), 0);
+    free(player->canvas);
+    player->canvas = (uint8_t *) malloc(player->gif.w * player->gif.h);
+
+    if (player->do_stream && gif_stream_start(&player->stream, &player->gif) == ERROR_OUT) {
+        return ERROR_OUT;
     }
+    ct_indices = player_expand(player, 0, &stride);
+    compose_first_frame(&color_frame, &player->gif, ct_indices, stride, lut);
+    if (compositor_is_active(&player->compositor, time_now_ns())) {
+        compose_layers(&player->compositor, &color_frame, time_now_ns(), lut);
+    }
+
+    /* A single frame would be rendered into its cache entry while it is sent */
+    player->is_cached = player->do_cache && player->gif.frames.length > 1;
+    if (player->is_cached) {
+        packet_cache_init(&player->cache, player->gif.frames.length, player->header);
+    }
+    player->is_cache_armed = 0;
 
-    brightness = (uint8_t) rd_char / 255.0 * MAX_BRIGHTNESS;
+    packets = player_render(player);
+    render_buffer_publish(&player->render, packets);
+    frame_clock_start(&player->clock, time_now_ns(), first_frame->delay);
+
+    return SUCC_OUT;
 }
 
-void *ser_thread_func(void *args __attribute__((unused))) {
-    int ser_fd;
+int player_load(struct player *player, struct gif *gif, const struct color_lut *lut) {
+    /* Switch to a newly loaded GIF, taking ownership of it. A GIF that
+       can't be played is freed and the current one keeps playing. If the
+       switch fails halfway the player can't go on, and shutdown is
+       requested */
+
+    struct gif old_gif = player->gif;
+    struct packet_cache old_cache = player->cache;
+    uint8_t was_cached = player->is_cached;
+    uint8_t was_show = player->is_show;
+
+    if (gif->w != LED_COLS || gif->h != LED_ROWS || !gif->frames.length) {
+        printf("Error: GIF must be %dx%d with at least one frame\n", LED_COLS, LED_ROWS);
+        gif_free(gif);
+        free(gif);
+        return ERROR_OUT;
+    }
 
-    if (get_ser_fd(&ser_fd) == ERROR_OUT) {
-        brightness = MAX_BRIGHTNESS;
-        pthread_exit(0);
+    if (was_show) {
+        player->is_show = 0;
+    }
+    else {
+        compositor_begin_transition(&player->compositor, color_frame.colors, time_now_ns());
+        if (player->do_stream) {
+            gif_stream_stop(&player->stream);
+        }
+    }
+    player->gif = *gif;
+    free(gif);
+
+    if (player_start(player, lut) == ERROR_OUT) {
+        /* Nothing is left to play. Old packets may still be in flight, the
+           old cache is freed on shutdown with the new GIF */
+        control_quit(player->control);
+        player->do_stream = 0;  /* No stream to stop */
+        if (was_show) {
+            show_close(&player->show);
+        }
+        else {
+            gif_free(&old_gif);
+        }
+        return ERROR_OUT;
     }
 
-    while (1) {
-        update_brightness(ser_fd);
+    /* Old cached packets may still be in flight until the new first frame
+       is taken */
+    player_wait_taken(player);
+    if (was_show) {
+        show_close(&player->show);
+        return SUCC_OUT;
+    }
+    if (was_cached) {
+        packet_cache_free(&old_cache);
     }
+    gif_free(&old_gif);
+
+    return SUCC_OUT;
 }
 
-int main(int argc, char **argv) {
-    int socket_fd;
-    
-    struct ifreq interface_id;
-    struct ifreq interface_mac;
+void player_redraw(struct player *player, uint64_t now, const struct color_lut *lut) {
+    /* Publish the current frame again with the compositor stack as of now */
 
-    struct ether_header *eth_head = (struct ether_header *) frame_buffer;
-    struct sockaddr_ll socket_address;
+    struct packet_set *packets;
+    uint64_t start;
 
-    uint16_t i;
+    compose_layers(&player->compositor, &color_frame, now, lut);
+    start = time_now_ns();
+    packets = player_render(player);
+    stats_record(STATS_PACKETIZE, time_now_ns() - start);
+    render_buffer_publish(&player->render, packets);
+}
 
-    struct timeval tv;
-    double millis;
-    double prev_millis = 0;
+void *render_thread_func(void *args) {
+    /* Compose and packetize each GIF frame when it is due, and hand it to
+       the transmit thread. Commands are applied between frames */
 
-    double last_frame_millis = 0;
-    uint16_t frame_index = 0;
+    struct player *player = (struct player *) args;
+    struct command command;
+    uint8_t is_paused = 0;
+    uint8_t is_step;
     struct frame *current_frame;
+    const uint8_t *ct_indices;
+    uint16_t stride;
+    struct gif *gif;
+    const struct color_lut *lut;
+    struct packet_set *packets;
+    uint64_t now;
+    uint64_t deadline;
+    size_t skips;
 
-    struct gif gif;
+    while (1) {
+        deadline = is_paused ? UINT64_MAX : player->clock.next;
+        if (!player->is_show && player->compositor.next_step < deadline) {
+            deadline = player->compositor.next_step;
+        }
+        control_wait(player->control, deadline);
+
+        is_step = 0;
+        while (control_next(player->control, &command)) {
+            switch (command.type) {
+                case COMMAND_LOAD:
+                    if (player_load(player, command.gif, color_table_get(&colors)) == ERROR_OUT) {
+                        if (control_is_stopped(player->control)) {
+                            return 0;
+                        }
+                        printf("Error: Could not start loaded GIF, keeping the current one\n");
+                    }
+                    break;
+                case COMMAND_PAUSE:
+                    is_paused = 1;
+                    break;
+                case COMMAND_RESUME:
+                    if (is_paused) {
+                        /* Current frame gets its full delay again */
+                        is_paused = 0;
+                        frame_clock_start(&player->clock, time_now_ns(), player_delay(player, player->frame_index));
+                    }
+                    break;
+                case COMMAND_NEXT:
+                    is_step = 1;
+                    break;
+                case COMMAND_LAYER:
+                    compositor_set_layer(&player->compositor, command.layer_index, &command.layer, command.gif);
+                    break;
+                case COMMAND_QUIT:
+                    return 0;
+            }
+        }
 
-    if (argc < 2) {
-        printf("Error: Please provide a GIF filename\n");
-        return ERROR_OUT;
+        now = time_now_ns();
+        if (is_step) {
+            player->clock.next = now;
+        }
+        else if (is_paused || now < player->clock.next) {
+            if (!player->is_show && now >= player->compositor.next_step) {
+                /* Between frames, a transition is running, a layer changed or a layer GIF is due */
+                if (!player_wait_taken(player)) {
+                    return 0;
+                }
+                player_redraw(player, time_now_ns(), color_table_get(&colors));
+            }
+            continue;
+        }
+
+        /* Never publish faster than refreshes are sent, for zero delay frames */
+        if (!player_wait_taken(player)) {
+            return 0;
+        }
+        now = time_now_ns();
+
+        if (player->is_show) {
+            /* Frames are independent, skip straight to the one due now */
+            skips = 0;
+            do {
+                if (++player->frame_index == player_length(player)) {
+                    player->frame_index = 0;
+                }
+                if (++skips == player_length(player)) {
+                    player->clock.next = now;
+                }
+            } while (!frame_clock_advance(&player->clock, now, player_delay(player, player->frame_index)));
+            stats_count(STATS_FRAMES_MISSED, skips - 1);
+
+            packets = render_buffer_back(&player->render);
+            player_fill_show(player, packets);
+            render_buffer_publish(&player->render, packets);
+            continue;
+        }
+
+        /* Once the playlist item is done, the next one replaces the next
+           frame. Until it has loaded, the current one keeps playing */
+        if (player->playlist &&
+            playlist_is_due(player->playlist, now, player->loops + ((size_t) player->frame_index + 1 == player_length(player))) &&
+            (gif = playlist_take(player->playlist, now))) {
+            if (player_load(player, gif, color_table_get(&colors)) == ERROR_OUT) {
+                if (control_is_stopped(player->control)) {
+                    return 0;
+                }
+                printf("Error: Could not start playlist item, keeping the current one\n");
+                continue;
+            }
+            printf("Playing %s\n", playlist_current(player->playlist)->filename);
+            continue;
+        }
+
+        /* Switch to the frame due now, compositing (but not sending) any
+           whose display time has already passed */
+        lut = color_table_get(&colors);
+        skips = 0;
+        do {
+            ++player->frame_index;
+            if (player->frame_index == player->gif.frames.length) {
+                player->frame_index = 0;
+                ++player->loops;
+
+                /* Frames are only cached once playback has looped, since
+                   the first pass composites over the first frame rather
+                   than the last one */
+                player->is_cache_armed = player->is_cached;
+            }
+            current_frame = (struct frame *) dyn_arr_get(&(player->gif.frames), player->frame_index);
+            ct_indices = player_expand(player, player->frame_index, &stride);
+
+            /* Always composite, transparent pixels of later frames depend on it */
+            compose_frame(&color_frame, &player->gif, current_frame, ct_indices, stride, lut);
+
+            if (++skips == player->gif.frames.length) {
+                /* Skipped a whole loop, give up catching up */
+                player->clock.next = now;
+            }
+        } while (!frame_clock_advance(&player->clock, now, current_frame->delay));
+        stats_count(STATS_FRAMES_MISSED, skips - 1);
+        stats_record(STATS_COMPOSE, time_now_ns() - now);
+
+        now = time_now_ns();
+        if (compositor_is_active(&player->compositor, now)) {
+            /* Cached packets hold the GIF alone */
+            player_redraw(player, now, lut);
+            continue;
+        }
+
+        /* Table was read before compositing, so a change during
+           compositing invalidates the cache on the next switch */
+        packets = 0;
+        if (player->is_cached) {
+            packets = packet_cache_get(&player->cache, player->frame_index, lut);
+        }
+        if (!packets) {
+            /* A set re-rendered after a color table change may be the one
+               being sent, in a one frame GIF or after skipping a whole
+               loop. It is cached again once it is no longer published */
+            if (player->is_cache_armed &&
+                !render_buffer_is_published(&player->render, player->cache.sets[player->frame_index])) {
+                packets = packet_cache_add(&player->cache, player->frame_index);
+                packet_set_render(packets, color_frame.adjusted);
+            }
+            else {
+                packets = player_render(player);
+            }
+            stats_record(STATS_PACKETIZE, time_now_ns() - now);
+        }
+
+        render_buffer_publish(&player->render, packets);
     }
+}
 
-    memset(frame_buffer, 0, FRAME_BYTES);
+int main(int argc, char **argv) {
+    struct tx tx;
+    enum tx_mode tx_mode = TX_SENDTO;
+    const char *interface_name = INTERFACE_NAME;
+    const char *tx_target = 0;  /* Sink file or address */
+    uint16_t batch = 0;  /* Packets per send call, 0 for the mode default */
+    double gap_us = 10;  /* Time between batches, for the FPGA */
+    double refresh_hz = 0;  /* Target refresh rate, 0 for as fast as the gap allows */
+    struct pacer pacer;
+    uint64_t last_report_ns = 0;
+    uint8_t do_stats = 1;
+    uint64_t now;
+
+    /* Delta refresh */
+    static struct packet_delta delta;
+    uint8_t do_delta = 0;
+    double keepalive_ms = 500;  /* Time between full refreshes */
+    uint64_t next_keepalive = 0;
+    uint8_t is_new;
+    uint16_t count;  /* Packets to send this refresh */
+    uint64_t sent = 0;
+    uint64_t batch_start, batch_end;
+    uint64_t pace_ns;  /* Time spent waiting on the pacer this refresh */
+    const char *stats_path = STATS_PATH;
+    double gamma = 1;
+    double balance[COLOR_CHANNELS] = {1, 1, 1};  /* G, R, B */
+    double balance_r, balance_g, balance_b;
+    uint8_t transition = TRANSITION_CUT;
+    uint64_t transition_ns = 0;
+    struct scale_options scaling = {SCALE_FIT, SCALE_AREA};
+
+    uint16_t i;
+
+    static struct player player;
+    static struct control control;
+    static struct playlist playlist;
+    const char *filename;
+    struct gif *gif;
+    const char *socket_path = CONTROL_SOCKET_PATH;
+    struct packet_set *packets;  /* Packets sent each refresh */
+    pthread_t render_thread;
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "sct:i:b:g:r:qG:w:S:dk:Px:M:f:")) != -1) {
+        switch (opt) {
+            case 's':
+                /* Decode frames on demand instead of all up front */
+                player.do_stream = 1;
+                break;
+            case 'c':
+                /* Keep rendered packets for every frame */
+                player.do_cache = 1;
+                break;
+            case 't':
+                /* Transmit backend: sendto, mmsg or ring on interface, or a
+                   null, pcap:<file>, udp:<host>:<port> or unix:<path> sink */
+                if (tx_parse_mode(&tx_mode, &tx_target, optarg) == ERROR_OUT) {
+                    return ERROR_OUT;
+                }
+                break;
+            case 'i':
+                interface_name = optarg;
+                break;
+            case 'b':
+                batch = atoi(optarg);
+                break;
+            case 'g':
+                gap_us = atof(optarg);
+                break;
+            case 'r':
+                refresh_hz = atof(optarg);
+                break;
+            case 'q':
+                /* No stats line */
+                do_stats = 0;
+                break;
+            case 'G':
+                gamma = atof(optarg);
+                if (gamma <= 0) {
+                    printf("Error: Gamma must be positive\n");
+                    return ERROR_OUT;
+                }
+                break;
+            case 'w':
+                /* White balance as R,G,B gains */
+                if (sscanf(optarg, "%lf,%lf,%lf", &balance_r, &balance_g, &balance_b) != 3) {
+                    printf("Error: White balance must be given as R,G,B\n");
+                    return ERROR_OUT;
+                }
+                balance[0] = balance_g;
+                balance[1] = balance_r;
+                balance[2] = balance_b;
+                break;
+            case 'S':
+                /* Command socket path */
+                socket_path = optarg;
+                break;
+            case 'd':
+                /* Only send packets that changed since they were last sent */
+                do_delta = 1;
+                break;
+            case 'k':
+                keepalive_ms = atof(optarg);
+                break;
+            case 'P':
+                /* Play a show compiled by ddfc instead of a GIF */
+                player.is_show = 1;
+                break;
+            case 'x':
+                /* Transition between GIFs: cut, fade:ms or wipe:ms */
+                if (compose_parse_transition(&transition, &transition_ns, optarg) == ERROR_OUT) {
+                    return ERROR_OUT;
+                }
+                break;
+            case 'M':
+                /* Stats segment path, for ddfstat */
+                stats_path = optarg;
+                break;
+            case 'f':
+                /* Fitting GIFs of another size to the floor: none, fit, fill,
+                   crop or stretch, optionally :nearest, :bilinear or :area */
+                if (scale_parse(&scaling, optarg) == ERROR_OUT) {
+                    return ERROR_OUT;
+                }
+                break;
+            default:
+                printf(
+                    "Usage: %s [-s] [-c] [-t sendto|mmsg|ring|null|pcap:file|udp:host:port|unix:path] [-i interface] "
+                    "[-b batch] [-g gap_us] [-r refresh_hz] [-q] [-G gamma] [-w r,g,b] [-S socket] [-d] [-k keepalive_ms] "
+                    "[-x cut|fade:ms|wipe:ms] [-M stats_path] [-f none|fit|fill|crop|stretch[:nearest|bilinear|area]] "
+                    "<gif> [<gif>[@seconds|@Nx] ...]\n"
+                    "       %s -P [options] <show>\n",
+                    argv[0],
+                    argv[0]
+                );
+                return ERROR_OUT;
+        }
+    }
 
-    if ((socket_fd = socket(AF_PACKET, SOCK_RAW, IPPROTO_RAW)) == -1) {
-        perror("Error [socket]");
+    if (optind >= argc) {
+        printf("Error: Please provide a %s filename\n", player.is_show ? "show" : "GIF");
         return ERROR_OUT;
     }
+    if (player.is_show && argc - optind > 1) {
+        printf("Error: Playlists take GIFs only\n");
+        return ERROR_OUT;
+    }
+
+    if (batch == 0 || batch > CHUNK_LEDS) {
+        /* Batched backends submit a whole refresh at once by default */
+        batch = tx_mode == TX_SENDTO ? 1 : CHUNK_LEDS;
+    }
 
-    /* Get interface index from name */
-    memset(&interface_id, 0, sizeof(struct ifreq));
-    strncpy(interface_id.ifr_name, INTERFACE_NAME, IFNAMSIZ);
-    if (ioctl(socket_fd, SIOCGIFINDEX, &interface_id) < 0) {
-        perror("Error [SIOCGIFINDEX]");
+    if (tx_open(&tx, tx_mode, tx_target ? tx_target : interface_name) == ERROR_OUT) {
         return ERROR_OUT;
     }
 
-    /* Get sender MAC address */
-    memset(&interface_mac, 0, sizeof(struct ifreq));
-    strncpy(interface_mac.ifr_name, INTERFACE_NAME, IFNAMSIZ);
-    if (ioctl(socket_fd, SIOCGIFHWADDR, &interface_mac) < 0) {
-        perror("Error [SIOCGIFHWADDR]");
+    /* Stage latencies are still recorded, only not visible to ddfstat */
+    if (stats_open(stats_path) == ERROR_OUT) {
+        printf("Warning: Stats segment unavailable\n");
+    }
+
+    color_table_init(&colors, MAX_BRIGHTNESS, gamma, balance);
+
+    /* Serial brightness, commands and signals are handled on a separate
+       thread. Started first so other threads inherit its signal mask */
+    if (control_start(&control, &colors, socket_path, player.do_stream, &scaling) == ERROR_OUT) {
         return ERROR_OUT;
     }
-    
-    /* Construct Ethernet header */
-    for (i = 0; i < 6; ++i) {
-        eth_head->ether_shost[i] = ((uint8_t *) &interface_mac.ifr_hwaddr.sa_data)[i];
 
-        /* Local MAC address, should match what FPGA is expecting */
-        if (i == 0) {
-            eth_head->ether_dhost[i] = 0x02;
-            socket_address.sll_addr[i] = 0x02;
+    if (player.is_show) {
+        /* Gamma and white balance are baked into the show, brightness is
+           scaled from the level it was compiled at */
+        if (show_open(&player.show, argv[optind]) == ERROR_OUT) {
+            return ERROR_OUT;
+        }
+        if (gamma != 1 || balance[0] != 1 || balance[1] != 1 || balance[2] != 1) {
+            printf("Warning: Gamma and white balance of a show are set by ddfc, ignoring -G and -w\n");
+        }
+        if (player.show.header->brightness > 0) {
+            color_table_init_scaled(&player.show_levels, MAX_BRIGHTNESS / player.show.header->brightness);
         }
         else {
-            eth_head->ether_dhost[i] = 0x00;
-            socket_address.sll_addr[i] = 0x00;
+            printf("Warning: Show was compiled at brightness 0, it stays off at every level\n");
+            color_table_init_scaled(&player.show_levels, 1);
+        }
+    }
+    else {
+        filename = argv[optind];
+        if (argc - optind > 1) {
+            /* Play each GIF in turn, later ones are loaded while playing */
+            playlist_init(&playlist, player.do_stream, &scaling);
+            while (optind < argc) {
+                if (playlist_add(&playlist, argv[optind++]) == ERROR_OUT) {
+                    return ERROR_OUT;
+                }
+            }
+            filename = playlist_current(&playlist)->filename;
+            player.playlist = &playlist;
         }
-     }
-    eth_head->ether_type = htons(ETH_P_IP);
-
-    socket_address.sll_ifindex = interface_id.ifr_ifindex;
-    socket_address.sll_halen = ETH_ALEN;
 
-    /* Control brightness using serial input on separate thread */
-    pthread_t ser_thread;
-    pthread_create(&ser_thread, NULL, ser_thread_func, NULL);
-    pthread_detach(ser_thread);
+        /* Load GIF file */
+        if (!(gif = frame_store_load(filename, player.do_stream, &scaling))) {
+            return ERROR_OUT;
+        }
+        player.gif = *gif;
+        free(gif);
+    }
 
-    /* Load GIF file */
-    gif_init(&gif);
-    if (prep_gif(&gif, argv[1]) == ERROR_OUT) {
+    player.header = tx.header;
+    player.control = &control;
+    render_buffer_init(&player.render, tx.header);
+    compositor_init(&player.compositor, transition, transition_ns);
+    packet_delta_init(&delta, tx.header);
+    if (player_start(&player, color_table_get(&colors)) == ERROR_OUT) {
+        return ERROR_OUT;
+    }
+    if (player.playlist && playlist_start(&playlist, time_now_ns()) == ERROR_OUT) {
         return ERROR_OUT;
     }
-    current_frame = (struct frame *) dyn_arr_get(&(gif.frames), 0);
 
-    #if DO_ETH
-        while (1) {
-            millis = get_millis(&tv);
+    pacer_init(&pacer, gap_us * 1000, refresh_hz > 0 ? 1e9 / refresh_hz : 0);
+    pacer_calibrate(&pacer);
 
-            printf("%f FPS\n", 1000 / (millis - prev_millis));
+    /* Render on a separate thread so frame switches do not stall refreshes */
+    pthread_create(&render_thread, NULL, render_thread_func, &player);
 
-            if (millis - last_frame_millis >= current_frame->delay * 10) {
-                /* Switch to next frame */
-                ++frame_index;
-                /*
-                printf(
-                    "Frame period target: %d, hit: %f\n",
-                    current_frame->delay * 10,
-                    millis - last_frame_millis
-                );
-                */
-                if (frame_index == gif.frames.length) {
-                    frame_index = 0;
+    #if DO_ETH
+        while (!control_is_stopped(&control)) {
+            packets = render_buffer_front(&player.render, &is_new);
+            count = CHUNK_LEDS;
+            now = time_now_ns();
+
+            if (do_delta) {
+                if (now >= next_keepalive) {
+                    /* Resend everything now and then, so the FPGA can't go stale */
+                    count = packet_delta_diff(&delta, packets, 1);
+                    next_keepalive = now + keepalive_ms * 1000000;
                 }
-                current_frame = (struct frame *) dyn_arr_get(&(gif.frames), frame_index);
-                last_frame_millis = millis;
-                load_gif_frame(current_frame);
-            }
-     
-            /* Send Ethernet packets for each LED */
-            for (i = 0; i < CHUNK_LEDS; ++i) {
-                /* Set LED index */
-                frame_buffer[HEADER_BYTES] = (uint8_t) (i & 0x00ff);
-                frame_buffer[HEADER_BYTES + 1] = (uint8_t) (i >> 8);
-
-                /* Set packet data */
-                color_frame_to_eth(i);
-
-                /* Send packet */
-                if (sendto(
-                        socket_fd,
-                        frame_buffer,
-                        FRAME_BYTES,
-                        0,
-                        (struct sockaddr *) &socket_address,
-                        sizeof(struct sockaddr_ll)
-                    ) < 0
-                ) {
-                    perror("Error [sendto]");
-                    return ERROR_OUT;
+                else {
+                    count = is_new ? packet_delta_diff(&delta, packets, 0) : 0;
                 }
+                packets = &delta.changed;
+            }
 
-                usleep(10);
+            if (count) {
+                /* Send Ethernet packets for each (changed) LED index */
+                pacer_wait_refresh(&pacer);
+                pace_ns = 0;
+                batch_end = now;
+                for (i = 0; i < count; i += batch) {
+                    pacer_wait_batch(&pacer);
+                    batch_start = time_now_ns();
+                    pace_ns += batch_start - batch_end;
+                    if (tx_send(&tx, packets, i, count - i < batch ? count - i : batch) == ERROR_OUT) {
+                        return ERROR_OUT;
+                    }
+                    batch_end = time_now_ns();
+                    stats_record(STATS_SEND, batch_end - batch_start);
+                }
+                stats_record(STATS_PACE, pace_ns);
+                stats_record(STATS_REFRESH, batch_end - now);
+                sent += count;
+            }
+            else {
+                /* Nothing changed, check back shortly */
+                time_wait_until(now + RENDER_POLL_NS, 0);
             }
 
-            prev_millis = millis;
+            if (do_stats && now - last_report_ns >= 1000000000ULL) {
+                frame_clock_report(&player.clock, stdout);
+                if (do_delta) {
+                    printf("Packets: %llu. ", (unsigned long long) sent);
+                    sent = 0;
+                }
+                pacer_report(&pacer, stdout);
+                last_report_ns = now;
+            }
         }
     #endif
 
-    gif_free(&gif);
-    close(socket_fd);
+    pthread_join(render_thread, NULL);
+    control_stop(&control);
+    if (player.playlist) {
+        playlist_stop(&playlist);
+    }
+
+    if (player.is_show) {
+        show_close(&player.show);
+    }
+    else {
+        if (player.is_cached) {
+            packet_cache_free(&player.cache);
+        }
+        if (player.do_stream) {
+            gif_stream_stop(&player.stream);
+        }
+        gif_free(&player.gif);
+    }
+    free(player.canvas);
+    compositor_free(&player.compositor);
+    tx_close(&tx);
+    stats_close();
 
     return SUCC_OUT;
 }
@@ -0,0 +1,503 @@
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define PACKET_HAS_X86 1
+#else
+    #define PACKET_HAS_X86 0
+#endif
+
+#include "packet.h"
+
+#define PACKET_LANES 32  /* CHUNKS padded to a full AVX2 register */
+
+enum packet_kernel packet_kernel = PACKET_KERNEL_AUTO;
+
+/* LED indices whose packets carry each pixel, CHUNK_LEDS where fewer do.
+   Column 0 of odd rows is read by two: its own row's LED, and through the
+   snake offset the LED of the even row before it that reads column 165 */
+static uint16_t packet_pixel_leds[LED_ROWS * LED_COLS][2];
+static pthread_once_t packet_pixel_leds_once = PTHREAD_ONCE_INIT;
+
+void color_frame_to_eth(
+    uint8_t *frame_buffer,
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS],
+    uint16_t led_index
+) {
+    /* 
+     * Fill frame_buffer with colors data at given led_index
+     * colors format: GRB, GRB, GRB, ... for each row and column of LEDs
+     * frame_buffer format: G bit 1, chunk 1; G bit 1, chunk 2; ...; B bit 8,i chunk 27
+     * Reference implementation, one bit at a time, see packet_fill
+     */
+
+    uint8_t chunk_led_row = led_index / CHUNK_COLS;
+    uint8_t chunk_led_col = led_index % CHUNK_COLS;
+
+    /* led_row and led_col are chunk indices above but with chunk offsets applied */
+    uint8_t led_row = 0;
+    uint8_t led_col = 0;
+
+    uint8_t i, j, k, l;
+    uint16_t frame_buffer_bit_index = 8 * (HEADER_BYTES + LED_INDEX_BYTES);
+
+    memset(frame_buffer + HEADER_BYTES + LED_INDEX_BYTES, 0, DATA_BYTES);
+
+    /* LEDs snake between rows */
+    if (chunk_led_row % 2 == 0) {
+        chunk_led_col = CHUNK_COLS - chunk_led_col;
+    }
+
+    for (i = 0; i < LED_CHANNELS; ++i) {
+        /* For each bit of the current channel */
+        for (j = 0; j < 8; ++j) {
+            /* For each row of chunks */
+            for (k = 0; k < 9; ++k) {
+                led_row = chunk_led_row + k * CHUNK_ROWS;
+                /* For each column of chunks */
+                for (l = 0; l < 3; ++l) {
+                    led_col = chunk_led_col + l * CHUNK_COLS;
+
+                    /* Select bit j from colors, place in chunk_index bit of current_bits */
+                    frame_buffer[frame_buffer_bit_index / 8] |= (
+                        ((colors[led_row][led_col][i] >> (7 - j)) & 1U) <<
+                        frame_buffer_bit_index % 8
+                    );
+
+                    ++frame_buffer_bit_index;
+                }
+            }
+        }
+    }
+}
+
+uint16_t eth_to_color_frame(
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS],
+    const uint8_t *frame_buffer
+) {
+    /*
+     * Inverse of color_frame_to_eth: write the 27 pixels carried by
+     * frame_buffer into colors and return its LED index, which the caller
+     * must check against CHUNK_LEDS. Pixels are addressed as one flat
+     * array, the same cells color_frame_to_eth reads from: the snake
+     * offset there reaches column 0 of each odd row through the end of
+     * the row before, and column 0 of even rows is never sent
+     */
+
+    uint8_t *pixels = &colors[0][0][0];
+    uint16_t led_index = frame_buffer[HEADER_BYTES] | (frame_buffer[HEADER_BYTES + 1] << 8);
+    uint8_t chunk_led_row = led_index / CHUNK_COLS;
+    uint8_t chunk_led_col = led_index % CHUNK_COLS;
+    uint8_t values[CHUNKS];
+    uint64_t bits;
+
+    uint8_t i, j, k, l, b;
+    uint16_t frame_buffer_bit_index = 8 * (HEADER_BYTES + LED_INDEX_BYTES);
+
+    if (led_index >= CHUNK_LEDS) {
+        return led_index;
+    }
+
+    if (chunk_led_row % 2 == 0) {
+        chunk_led_col = CHUNK_COLS - chunk_led_col;
+    }
+
+    for (i = 0; i < LED_CHANNELS; ++i) {
+        memset(values, 0, sizeof(values));
+
+        /* Each bit of the channel is a run of one bit per chunk, MSB first */
+        for (j = 0; j < 8; ++j) {
+            bits = 0;
+            for (b = 0; b < 5 && frame_buffer_bit_index / 8 + b < FRAME_BYTES; ++b) {
+                bits |= (uint64_t) frame_buffer[frame_buffer_bit_index / 8 + b] << (8 * b);
+            }
+            bits >>= frame_buffer_bit_index % 8;
+
+            for (k = 0; k < CHUNKS; ++k) {
+                values[k] = (values[k] << 1) | ((bits >> k) & 1U);
+            }
+            frame_buffer_bit_index += CHUNKS;
+        }
+
+        /* Chunk rows outer, chunk columns inner */
+        for (k = 0; k < 9; ++k) {
+            for (l = 0; l < 3; ++l) {
+                pixels[
+                    ((chunk_led_row + k * CHUNK_ROWS) * LED_COLS + chunk_led_col + l * CHUNK_COLS) *
+                    LED_CHANNELS + i
+                ] = values[k * 3 + l];
+            }
+        }
+    }
+
+    return led_index;
+}
+
+static void packet_gather(
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS],
+    uint16_t led_index,
+    uint8_t lanes[LED_CHANNELS][PACKET_LANES]
+) {
+    /* Collect the 27 chunk pixels for led_index into one byte lane per chunk,
+       in the order their bits go out: chunk rows outer, chunk columns inner */
+
+    const uint8_t *pixels = &colors[0][0][0];
+    uint8_t chunk_led_row = led_index / CHUNK_COLS;
+    uint8_t chunk_led_col = led_index % CHUNK_COLS;
+    const uint8_t *pixel;
+    uint8_t k, l;
+    uint8_t lane = 0;
+
+    /* LEDs snake between rows
+       Column CHUNK_COLS of a row is read as column 0 of the next one */
+    if (chunk_led_row % 2 == 0) {
+        chunk_led_col = CHUNK_COLS - chunk_led_col;
+    }
+
+    for (k = 0; k < 9; ++k) {
+        for (l = 0; l < 3; ++l) {
+            pixel = pixels + ((chunk_led_row + k * CHUNK_ROWS) * LED_COLS +
+                chunk_led_col + l * CHUNK_COLS) * LED_CHANNELS;
+            lanes[0][lane] = pixel[0];
+            lanes[1][lane] = pixel[1];
+            lanes[2][lane] = pixel[2];
+            ++lane;
+        }
+    }
+
+    for (; lane < PACKET_LANES; ++lane) {
+        lanes[0][lane] = 0;
+        lanes[1][lane] = 0;
+        lanes[2][lane] = 0;
+    }
+}
+
+static void packet_pack(uint8_t *data, const uint32_t masks[LED_BITS]) {
+    /* Concatenate 27-bit chunk masks, LSB first, into DATA_BYTES of data */
+
+    uint64_t acc = 0;
+    uint8_t acc_bits = 0;
+    uint8_t i;
+
+    for (i = 0; i < LED_BITS; ++i) {
+        acc |= ((uint64_t) masks[i]) << acc_bits;
+        acc_bits += CHUNKS;
+        if (acc_bits >= 32) {
+            data[0] = (uint8_t) acc;
+            data[1] = (uint8_t) (acc >> 8);
+            data[2] = (uint8_t) (acc >> 16);
+            data[3] = (uint8_t) (acc >> 24);
+            data += 4;
+            acc >>= 32;
+            acc_bits -= 32;
+        }
+    }
+
+    /* LED_BITS * CHUNKS = 648 bits, one byte left over */
+    while (acc_bits) {
+        *data++ = (uint8_t) acc;
+        acc >>= 8;
+        acc_bits -= 8;
+    }
+}
+
+static void packet_masks_scalar(uint8_t lanes[LED_CHANNELS][PACKET_LANES], uint32_t masks[LED_BITS]) {
+    /* Bit-plane masks via 8x8 bit matrix transposes, 8 lanes at a time */
+
+    uint64_t x, t;
+    uint8_t i, j, g;
+
+    for (i = 0; i < LED_BITS; ++i) {
+        masks[i] = 0;
+    }
+
+    for (i = 0; i < LED_CHANNELS; ++i) {
+        for (g = 0; g < PACKET_LANES / 8; ++g) {
+            memcpy(&x, lanes[i] + 8 * g, 8);
+            #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                x = __builtin_bswap64(x);
+            #endif
+
+            /* Byte r bit c becomes byte c bit r */
+            t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+            x = x ^ t ^ (t << 7);
+            t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+            x = x ^ t ^ (t << 14);
+            t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+            x = x ^ t ^ (t << 28);
+
+            /* Byte c now holds bit c of each lane, MSB goes out first */
+            for (j = 0; j < 8; ++j) {
+                masks[i * 8 + j] |= ((uint32_t) ((x >> (8 * (7 - j))) & 0xFF)) << (8 * g);
+            }
+        }
+    }
+}
+
+#if PACKET_HAS_X86 && defined(__SSE2__)
+static void packet_masks_sse2(uint8_t lanes[LED_CHANNELS][PACKET_LANES], uint32_t masks[LED_BITS]) {
+    /* Shift bit 7 - j of every lane up to the sign bit and collect with movemask */
+
+    __m128i lo, hi;
+    uint8_t i, j;
+
+    for (i = 0; i < LED_CHANNELS; ++i) {
+        lo = _mm_loadu_si128((const __m128i *) lanes[i]);
+        hi = _mm_loadu_si128((const __m128i *) (lanes[i] + 16));
+        for (j = 0; j < 8; ++j) {
+            masks[i * 8 + j] = (uint32_t) _mm_movemask_epi8(lo) |
+                ((uint32_t) _mm_movemask_epi8(hi) << 16);
+            lo = _mm_slli_epi16(lo, 1);
+            hi = _mm_slli_epi16(hi, 1);
+        }
+    }
+}
+#endif
+
+#if PACKET_HAS_X86
+__attribute__((target("avx2")))
+static void packet_masks_avx2(uint8_t lanes[LED_CHANNELS][PACKET_LANES], uint32_t masks[LED_BITS]) {
+    /* Same as packet_masks_sse2 with all 32 lanes in one register */
+
+    __m256i v;
+    uint8_t i, j;
+
+    for (i = 0; i < LED_CHANNELS; ++i) {
+        v = _mm256_loadu_si256((const __m256i *) lanes[i]);
+        for (j = 0; j < 8; ++j) {
+            masks[i * 8 + j] = (uint32_t) _mm256_movemask_epi8(v);
+            v = _mm256_slli_epi16(v, 1);
+        }
+    }
+}
+#endif
+
+static enum packet_kernel packet_resolve_kernel(void) {
+    /* Pick the fastest kernel this CPU supports, unless one was requested */
+
+    if (packet_kernel != PACKET_KERNEL_AUTO) {
+        return packet_kernel;
+    }
+
+    #if PACKET_HAS_X86
+        if (__builtin_cpu_supports("avx2")) {
+            return PACKET_KERNEL_AVX2;
+        }
+        #if defined(__SSE2__)
+            return PACKET_KERNEL_SSE2;
+        #endif
+    #endif
+
+    return PACKET_KERNEL_SCALAR;
+}
+
+void packet_fill(
+    uint8_t *frame_buffer,
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS],
+    uint16_t led_index
+) {
+    /* Same output as color_frame_to_eth, computed one bit plane at a time:
+       gather the 27 chunk bytes of each channel into lanes, then extract
+       each of the 8 bit planes of a channel as a 27-bit mask */
+
+    uint8_t lanes[LED_CHANNELS][PACKET_LANES];
+    uint32_t masks[LED_BITS];
+
+    packet_gather(colors, led_index, lanes);
+
+    switch (packet_resolve_kernel()) {
+        #if PACKET_HAS_X86
+            case PACKET_KERNEL_AVX2:
+                packet_masks_avx2(lanes, masks);
+                break;
+        #endif
+        #if PACKET_HAS_X86 && defined(__SSE2__)
+            case PACKET_KERNEL_SSE2:
+                packet_masks_sse2(lanes, masks);
+                break;
+        #endif
+        case PACKET_KERNEL_REFERENCE:
+            color_frame_to_eth(frame_buffer, colors, led_index);
+            return;
+        default:
+            packet_masks_scalar(lanes, masks);
+            break;
+    }
+
+    packet_pack(frame_buffer + HEADER_BYTES + LED_INDEX_BYTES, masks);
+}
+
+void packet_set_init(struct packet_set *set, const uint8_t *header) {
+    /* Write Ethernet header and LED index into every packet */
+
+    uint16_t i;
+
+    for (i = 0; i < CHUNK_LEDS; ++i) {
+        memcpy(set->packets[i], header, HEADER_BYTES);
+        set->packets[i][HEADER_BYTES] = (uint8_t) (i & 0x00ff);
+        set->packets[i][HEADER_BYTES + 1] = (uint8_t) (i >> 8);
+        memset(set->packets[i] + HEADER_BYTES + LED_INDEX_BYTES, 0, DATA_BYTES);
+    }
+}
+
+void packet_set_render(struct packet_set *set, uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS]) {
+    /* Fill packet data for every LED index from colors */
+
+    uint16_t i;
+
+    for (i = 0; i < CHUNK_LEDS; ++i) {
+        packet_fill(set->packets[i], colors, i);
+    }
+}
+
+void packet_set_render_stale(
+    struct packet_set *set,
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS],
+    uint8_t stale[CHUNK_LEDS]
+) {
+    /* Fill packet data for the LED indices marked in stale, and clear them */
+
+    uint16_t i;
+
+    for (i = 0; i < CHUNK_LEDS; ++i) {
+        if (stale[i]) {
+            packet_fill(set->packets[i], colors, i);
+            stale[i] = 0;
+        }
+    }
+}
+
+static void packet_map_pixels(void) {
+    /* Walk the cells each LED index reads, as in packet_gather */
+
+    uint16_t i;
+    uint16_t led_index;
+    uint16_t *leds;
+    uint8_t chunk_led_row, chunk_led_col;
+    uint8_t k, l;
+
+    for (i = 0; i < LED_ROWS * LED_COLS; ++i) {
+        packet_pixel_leds[i][0] = CHUNK_LEDS;
+        packet_pixel_leds[i][1] = CHUNK_LEDS;
+    }
+
+    for (led_index = 0; led_index < CHUNK_LEDS; ++led_index) {
+        chunk_led_row = led_index / CHUNK_COLS;
+        chunk_led_col = led_index % CHUNK_COLS;
+        if (chunk_led_row % 2 == 0) {
+            chunk_led_col = CHUNK_COLS - chunk_led_col;
+        }
+        for (k = 0; k < 9; ++k) {
+            for (l = 0; l < 3; ++l) {
+                leds = packet_pixel_leds[(chunk_led_row + k * CHUNK_ROWS) * LED_COLS + chunk_led_col + l * CHUNK_COLS];
+                leds[leds[0] < CHUNK_LEDS] = led_index;
+            }
+        }
+    }
+}
+
+void packet_mark_rect(uint8_t stale[CHUNK_LEDS], const struct rect *rect) {
+    /* Mark the LED indices whose packets carry any pixel of rect */
+
+    uint16_t (*leds)[2];
+    uint16_t row, col;
+
+    if (rect->w == LED_COLS && rect->h == LED_ROWS) {
+        memset(stale, 1, CHUNK_LEDS);
+        return;
+    }
+
+    pthread_once(&packet_pixel_leds_once, packet_map_pixels);
+
+    for (row = rect->top; row < rect->top + rect->h; ++row) {
+        leds = packet_pixel_leds + row * LED_COLS;
+        for (col = rect->left; col < rect->left + rect->w; ++col) {
+            if (leds[col][0] < CHUNK_LEDS) {
+                stale[leds[col][0]] = 1;
+            }
+            if (leds[col][1] < CHUNK_LEDS) {
+                stale[leds[col][1]] = 1;
+            }
+        }
+    }
+}
+
+void packet_cache_init(struct packet_cache *cache, size_t length, const uint8_t *header) {
+    cache->sets = (struct packet_set **) calloc(length, sizeof(struct packet_set *));
+    cache->is_valid = (uint8_t *) calloc(length, 1);
+    cache->length = length;
+    cache->lut = 0;
+    memcpy(cache->header, header, HEADER_BYTES);
+}
+
+struct packet_set *packet_cache_get(struct packet_cache *cache, size_t index, const struct color_lut *lut) {
+    /* Return rendered packet set for GIF frame index, or null if it needs
+       to be (re-)rendered with packet_cache_add */
+
+    if (lut != cache->lut) {
+        /* Every set was rendered with the old table, re-derive lazily.
+           Allocations are kept, packet_cache_add reuses them */
+        memset(cache->is_valid, 0, cache->length);
+        cache->lut = lut;
+    }
+
+    if (!cache->is_valid[index]) {
+        return 0;
+    }
+
+    return cache->sets[index];
+}
+
+struct packet_set *packet_cache_add(struct packet_cache *cache, size_t index) {
+    /* Get storage for GIF frame index, to be filled with packet_set_render */
+
+    if (!cache->sets[index]) {
+        cache->sets[index] = (struct packet_set *) malloc(sizeof(struct packet_set));
+        packet_set_init(cache->sets[index], cache->header);
+    }
+    cache->is_valid[index] = 1;
+
+    return cache->sets[index];
+}
+
+void packet_cache_free(struct packet_cache *cache) {
+    size_t i;
+
+    for (i = 0; i < cache->length; ++i) {
+        free(cache->sets[i]);
+    }
+
+    free(cache->sets);
+    free(cache->is_valid);
+    cache->sets = 0;
+    cache->is_valid = 0;
+    cache->length = 0;
+}
+
+void packet_delta_init(struct packet_delta *delta, const uint8_t *header) {
+    packet_set_init(&delta->changed, header);
+    memset(delta->sent, 0, sizeof(delta->sent));
+}
+
+uint16_t packet_delta_diff(struct packet_delta *delta, struct packet_set *set, uint8_t is_full) {
+    /* Copy packets of set whose payload differs from the last one sent (or
+       all of them if is_full) to the front of delta->changed, and record them
+       as sent. Return how many were copied */
+
+    uint16_t i;
+    uint16_t count = 0;
+    uint8_t *payload;
+
+    for (i = 0; i < CHUNK_LEDS; ++i) {
+        payload = set->packets[i] + HEADER_BYTES + LED_INDEX_BYTES;
+        if (!is_full && !memcmp(payload, delta->sent[i], DATA_BYTES)) {
+            continue;
+        }
+        memcpy(delta->sent[i], payload, DATA_BYTES);
+        memcpy(delta->changed.packets[count++], set->packets[i], FRAME_BYTES);
+    }
+
+    return count;
+}
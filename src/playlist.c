@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "global_defines.h"
+#include "playlist.h"
+#include "frame_store.h"
+
+#define PLAYLIST_NICE 10  /* Loading yields to rendering and sending */
+
+static void *playlist_thread_func(void *args) {
+    /* Load the wanted item whenever the render thread has taken the last one */
+
+    struct playlist *playlist = (struct playlist *) args;
+    struct playlist_item *item;
+    struct gif *gif;
+    size_t index;
+    size_t tries;
+
+    /* Decode threads started from here inherit this */
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), PLAYLIST_NICE) < 0) {
+        perror("Error [setpriority]");
+    }
+
+    pthread_mutex_lock(&playlist->lock);
+    while (1) {
+        while (!playlist->stop && !playlist->is_wanted) {
+            pthread_cond_wait(&playlist->wake, &playlist->lock);
+        }
+        if (playlist->stop) {
+            break;
+        }
+        playlist->is_wanted = 0;
+        index = playlist->next;
+        pthread_mutex_unlock(&playlist->lock);
+
+        /* Items that fail to load are skipped, up to trying each once. If
+           none load, the current item keeps playing for another turn */
+        gif = 0;
+        for (tries = 0; tries < playlist->items.length; ++tries) {
+            item = (struct playlist_item *) dyn_arr_get(&playlist->items, index);
+            if ((gif = frame_store_load(item->filename, playlist->lazy_decode, &playlist->scaling))) {
+                break;
+            }
+            printf("Error: Skipping playlist item %s\n", item->filename);
+            index = (index + 1) % playlist->items.length;
+        }
+
+        pthread_mutex_lock(&playlist->lock);
+        playlist->next = index;
+        playlist->ready = gif;
+        playlist->is_failed = !gif;
+    }
+    pthread_mutex_unlock(&playlist->lock);
+
+    return 0;
+}
+
+void playlist_init(struct playlist *playlist, uint8_t lazy_decode, const struct scale_options *scaling) {
+    dyn_arr_init(&playlist->items, 8, sizeof(struct playlist_item));
+    playlist->lazy_decode = lazy_decode;
+    playlist->scaling = *scaling;
+    playlist->current = 0;
+    playlist->started = 0;
+    playlist->extended = 0;
+    playlist->next = 0;
+    playlist->is_wanted = 0;
+    playlist->is_failed = 0;
+    playlist->stop = 0;
+    playlist->ready = 0;
+}
+
+int playlist_add(struct playlist *playlist, char *arg) {
+    /* Add an item given as path, path@seconds or path@Nx (N loops) */
+
+    struct playlist_item item;
+    char *suffix = strrchr(arg, '@');
+    char *end;
+    double seconds;
+
+    item.filename = arg;
+    item.duration = 0;
+    item.loops = PLAYLIST_LOOPS;
+
+    if (suffix) {
+        *suffix++ = 0;
+        if (suffix[0] && suffix[strlen(suffix) - 1] == 'x') {
+            item.loops = strtoul(suffix, &end, 10);
+            if (end != suffix + strlen(suffix) - 1 || !item.loops) {
+                printf("Error: Invalid loop count for playlist item %s\n", arg);
+                return ERROR_OUT;
+            }
+        }
+        else {
+            seconds = strtod(suffix, &end);
+            if (end == suffix || *end || seconds <= 0) {
+                printf("Error: Invalid duration for playlist item %s\n", arg);
+                return ERROR_OUT;
+            }
+            item.duration = seconds * 1e9;
+        }
+    }
+
+    dyn_arr_append(&playlist->items, &item);
+
+    return SUCC_OUT;
+}
+
+struct playlist_item *playlist_current(struct playlist *playlist) {
+    return (struct playlist_item *) dyn_arr_get(&playlist->items, playlist->current);
+}
+
+int playlist_start(struct playlist *playlist, uint64_t now) {
+    /* Start preloading the second item, the first one is loaded by the caller
+       and started at now. Must be called after control_start, so the loader
+       thread does not take termination signals */
+
+    playlist->current = 0;
+    playlist->started = now;
+    playlist->extended = 0;
+    playlist->next = 1 % playlist->items.length;
+    playlist->is_wanted = 1;
+
+    pthread_mutex_init(&playlist->lock, NULL);
+    pthread_cond_init(&playlist->wake, NULL);
+    if (pthread_create(&playlist->thread, NULL, playlist_thread_func, playlist) != 0) {
+        printf("Error: Could not start playlist thread\n");
+        return ERROR_OUT;
+    }
+
+    return SUCC_OUT;
+}
+
+uint8_t playlist_is_due(struct playlist *playlist, uint64_t now, uint32_t loops) {
+    /* Whether the current item is done, given the loops it has played once
+       the current frame ends */
+
+    struct playlist_item *item = playlist_current(playlist);
+    uint32_t turns = playlist->extended + 1;
+
+    if (item->duration) {
+        return now - playlist->started >= item->duration * turns;
+    }
+    return loops >= item->loops * turns;
+}
+
+struct gif *playlist_take(struct playlist *playlist, uint64_t now) {
+    /* Take the next item if it has finished loading, null if not. The taken
+       item becomes current as of now, and loading the one after starts.
+       If no item could be loaded, the current one plays another turn and
+       loading is tried again */
+
+    struct gif *gif;
+
+    pthread_mutex_lock(&playlist->lock);
+    if ((gif = playlist->ready)) {
+        playlist->ready = 0;
+        playlist->current = playlist->next;
+        playlist->next = (playlist->current + 1) % playlist->items.length;
+        playlist->is_wanted = 1;
+        pthread_cond_signal(&playlist->wake);
+    }
+    else if (playlist->is_failed) {
+        playlist->is_failed = 0;
+        playlist->next = (playlist->current + 1) % playlist->items.length;
+        playlist->is_wanted = 1;
+        ++playlist->extended;
+        pthread_cond_signal(&playlist->wake);
+    }
+    pthread_mutex_unlock(&playlist->lock);
+
+    if (gif) {
+        playlist->started = now;
+        playlist->extended = 0;
+    }
+
+    return gif;
+}
+
+void playlist_stop(struct playlist *playlist) {
+    /* Wait for any load in progress and free what is not taken */
+
+    pthread_mutex_lock(&playlist->lock);
+    playlist->stop = 1;
+    pthread_cond_signal(&playlist->wake);
+    pthread_mutex_unlock(&playlist->lock);
+    pthread_join(playlist->thread, NULL);
+
+    if (playlist->ready) {
+        gif_free(playlist->ready);
+        free(playlist->ready);
+    }
+    pthread_mutex_destroy(&playlist->lock);
+    pthread_cond_destroy(&playlist->wake);
+    dyn_arr_free(&playlist->items);
+}
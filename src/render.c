@@ -0,0 +1,97 @@
+#include <string.h>
+
+#include "render.h"
+
+void render_buffer_init(struct render_buffer *buf, const uint8_t *header) {
+    uint8_t i;
+
+    for (i = 0; i < RENDER_SLOTS; ++i) {
+        packet_set_init(&buf->sets[i], header);
+        buf->packets[i] = &buf->sets[i];
+    }
+    memset(buf->stale, 1, sizeof(buf->stale));
+
+    buf->back = 0;
+    buf->middle = 1;
+    buf->front = 2;
+}
+
+struct packet_set *render_buffer_back(struct render_buffer *buf) {
+    /* Storage the render thread may write anything into */
+
+    memset(buf->stale[buf->back], 1, CHUNK_LEDS);
+    return &buf->sets[buf->back];
+}
+
+void render_buffer_invalidate(struct render_buffer *buf, const struct rect *rect) {
+    /* Pixels in rect changed, every slot has to render their packets again */
+
+    uint8_t i;
+
+    for (i = 0; i < RENDER_SLOTS; ++i) {
+        packet_mark_rect(buf->stale[i], rect);
+    }
+}
+
+struct packet_set *render_buffer_render(
+    struct render_buffer *buf,
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS]
+) {
+    /* Bring the back storage up to date with colors, rendering only the
+       packets invalidated since it last was */
+
+    struct packet_set *set = &buf->sets[buf->back];
+
+    packet_set_render_stale(set, colors, buf->stale[buf->back]);
+    return set;
+}
+
+void render_buffer_publish(struct render_buffer *buf, struct packet_set *packets) {
+    /* Hand packets to the transmit thread, replacing any refresh it has not
+       taken yet. packets must stay unchanged until it is replaced in turn */
+
+    uint8_t prev;
+
+    buf->packets[buf->back] = packets;
+    prev = __atomic_exchange_n(&buf->middle, buf->back | RENDER_FRESH, __ATOMIC_ACQ_REL);
+    buf->back = prev & ~RENDER_FRESH;
+}
+
+uint8_t render_buffer_is_published(struct render_buffer *buf, const struct packet_set *packets) {
+    /* Whether packets may still be taken or sent by the transmit thread,
+       which it may be as long as a slot other than back holds them.
+       Render thread only */
+
+    uint8_t i;
+
+    for (i = 0; i < RENDER_SLOTS; ++i) {
+        if (i != buf->back && buf->packets[i] == packets) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+uint8_t render_buffer_is_pending(struct render_buffer *buf) {
+    /* Whether the last published refresh has not been taken yet */
+    return (__atomic_load_n(&buf->middle, __ATOMIC_ACQUIRE) & RENDER_FRESH) != 0;
+}
+
+struct packet_set *render_buffer_front(struct render_buffer *buf, uint8_t *is_new) {
+    /* Latest published refresh, called by the transmit thread at refresh
+       start. is_new (if not null) is set if it was not returned before */
+
+    uint8_t prev;
+    uint8_t is_pending = render_buffer_is_pending(buf);
+
+    if (is_pending) {
+        prev = __atomic_exchange_n(&buf->middle, buf->front, __ATOMIC_ACQ_REL);
+        buf->front = prev & ~RENDER_FRESH;
+    }
+    if (is_new) {
+        *is_new = is_pending;
+    }
+
+    return buf->packets[buf->front];
+}
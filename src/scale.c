@@ -0,0 +1,485 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+    #include <emmintrin.h>
+    #define SCALE_HAS_SSE2 1
+#else
+    #define SCALE_HAS_SSE2 0
+#endif
+
+#include "scale.h"
+
+#define SCALE_CACHE_SIZE 16384  /* Nearest color cache entries, more than the floor has pixels */
+#define SCALE_CACHE_USED 0x1000000  /* Set in the keys of used entries */
+
+int scale_parse(struct scale_options *options, const char *arg) {
+    /* Given as mode or mode:filter, the filter defaults to area */
+
+    const char *colon = strchr(arg, ':');
+    size_t name_length = colon ? (size_t) (colon - arg) : strlen(arg);
+
+    if (!strncmp(arg, "none", name_length) && name_length == 4) {
+        options->mode = SCALE_NONE;
+    }
+    else if (!strncmp(arg, "fit", name_length) && name_length == 3) {
+        options->mode = SCALE_FIT;
+    }
+    else if (!strncmp(arg, "fill", name_length) && name_length == 4) {
+        options->mode = SCALE_FILL;
+    }
+    else if (!strncmp(arg, "crop", name_length) && name_length == 4) {
+        options->mode = SCALE_CROP;
+    }
+    else if (!strncmp(arg, "stretch", name_length) && name_length == 7) {
+        options->mode = SCALE_STRETCH;
+    }
+    else {
+        printf("Error: Unknown scale mode %.*s\n", (int) name_length, arg);
+        return ERROR_OUT;
+    }
+
+    options->filter = SCALE_AREA;
+    if (!colon) {
+        return SUCC_OUT;
+    }
+    if (!strcmp(colon + 1, "nearest")) {
+        options->filter = SCALE_NEAREST;
+    }
+    else if (!strcmp(colon + 1, "bilinear")) {
+        options->filter = SCALE_BILINEAR;
+    }
+    else if (!strcmp(colon + 1, "area")) {
+        options->filter = SCALE_AREA;
+    }
+    else {
+        printf("Error: Unknown scale filter %s\n", colon + 1);
+        return ERROR_OUT;
+    }
+
+    return SUCC_OUT;
+}
+
+static uint32_t scale_clamp(double position, uint16_t size) {
+    if (position < 0) {
+        return 0;
+    }
+    return position >= size ? (uint32_t) size - 1 : (uint32_t) position;
+}
+
+static void scale_axis_init(
+    struct scale_axis *axis,
+    uint16_t src,
+    uint16_t dst,
+    double factor,
+    uint8_t filter
+) {
+    /* Taps for src pixels scaled by factor and centered on dst pixels. An
+       image that ends up smaller than dst covers part of it, a larger one
+       is cut off evenly on both sides */
+
+    double step;  /* Source pixels per output pixel */
+    double start;  /* Source position of the first output pixel's edge */
+    double center, fraction, from, to, overlap;
+    uint32_t *index;  /* Taps of one output pixel, before laying them out */
+    uint16_t *weight;
+    uint32_t total, first;
+    uint16_t o, k, n, largest;
+    long p;
+
+    if (src * factor <= dst) {
+        axis->length = (uint16_t) (src * factor + 0.5);
+        axis->length = axis->length ? axis->length : 1;
+        axis->offset = (dst - axis->length) / 2;
+        step = (double) src / axis->length;
+        start = 0;
+    }
+    else {
+        axis->length = dst;
+        axis->offset = 0;
+        step = 1 / factor;
+        start = (src - dst * step) / 2;
+    }
+
+    switch (filter) {
+        case SCALE_NEAREST:
+            axis->taps = 1;
+            break;
+        case SCALE_BILINEAR:
+            axis->taps = 2;
+            break;
+        default:
+            axis->taps = (uint16_t) ceil(step) + 1;
+            break;
+    }
+    axis->taps = axis->taps < src ? axis->taps : src;
+    axis->first = (uint32_t *) malloc(axis->length * sizeof(uint32_t));
+    axis->weight = (uint16_t *) calloc(axis->length * axis->taps, sizeof(uint16_t));
+    index = (uint32_t *) malloc((axis->taps + 1) * sizeof(uint32_t));
+    weight = (uint16_t *) malloc((axis->taps + 1) * sizeof(uint16_t));
+
+    for (o = 0; o < axis->length; ++o) {
+        n = 0;
+
+        switch (filter) {
+            case SCALE_NEAREST:
+                index[n] = scale_clamp(floor(start + (o + 0.5) * step), src);
+                weight[n++] = SCALE_WEIGHT_ONE;
+                break;
+            case SCALE_BILINEAR:
+                center = start + (o + 0.5) * step - 0.5;
+                fraction = center - floor(center);
+                index[n] = scale_clamp(floor(center), src);
+                weight[n++] = (uint16_t) ((1 - fraction) * SCALE_WEIGHT_ONE + 0.5);
+                index[n] = scale_clamp(floor(center) + 1, src);
+                weight[n++] = (uint16_t) (fraction * SCALE_WEIGHT_ONE + 0.5);
+                break;
+            default:
+                /* Box of one output pixel, weighed by how much of each
+                   source pixel it covers */
+                from = start + o * step;
+                to = from + step;
+                for (p = (long) floor(from); p < to && n <= axis->taps; ++p) {
+                    overlap = fmin(to, p + 1) - fmax(from, p);
+                    if (overlap <= 0) {
+                        continue;
+                    }
+                    index[n] = scale_clamp(p, src);
+                    weight[n++] = (uint16_t) (overlap / step * SCALE_WEIGHT_ONE + 0.5);
+                }
+                break;
+        }
+
+        /* Rounding leftovers go to the heaviest tap, so weights sum to one
+           exactly and opaque pixels stay opaque */
+        total = 0;
+        largest = 0;
+        for (k = 0; k < n; ++k) {
+            total += weight[k];
+            largest = weight[k] > weight[largest] ? k : largest;
+        }
+        weight[largest] += SCALE_WEIGHT_ONE - total;
+
+        /* Lay taps out as a run of source pixels that stays inside src,
+           clamped taps land on the same pixel */
+        first = index[0];
+        for (k = 1; k < n; ++k) {
+            first = index[k] < first ? index[k] : first;
+        }
+        first = first + axis->taps > src ? (uint32_t) src - axis->taps : first;
+        axis->first[o] = first;
+        for (k = 0; k < n; ++k) {
+            axis->weight[o * axis->taps + index[k] - first] += weight[k];
+        }
+    }
+
+    free(index);
+    free(weight);
+}
+
+int scale_init(
+    struct scale *scale,
+    uint16_t src_w, uint16_t src_h,
+    uint16_t dst_w, uint16_t dst_h,
+    const struct scale_options *options
+) {
+    /* Plan scaling a src_w x src_h logical screen onto dst_w x dst_h */
+
+    double factor_x = (double) dst_w / src_w;
+    double factor_y = (double) dst_h / src_h;
+
+    if (options->mode == SCALE_NONE) {
+        printf("Error: GIF is %dx%d, must be %dx%d without a scale mode\n", src_w, src_h, dst_w, dst_h);
+        return ERROR_OUT;
+    }
+    if (!src_w || !src_h) {
+        printf("Error: GIF has an empty logical screen\n");
+        return ERROR_OUT;
+    }
+
+    scale->src_w = src_w;
+    scale->src_h = src_h;
+    scale->dst_w = dst_w;
+    scale->dst_h = dst_h;
+
+    /* Unscaled, every filter would copy pixels as they are */
+    scale->filter = options->mode == SCALE_CROP ? SCALE_NEAREST : options->filter;
+
+    switch (options->mode) {
+        case SCALE_FIT:
+            factor_x = factor_y = fmin(factor_x, factor_y);
+            break;
+        case SCALE_FILL:
+            factor_x = factor_y = fmax(factor_x, factor_y);
+            break;
+        case SCALE_CROP:
+            factor_x = factor_y = 1;
+            break;
+        default:
+            break;
+    }
+
+    scale_axis_init(&scale->x, src_w, dst_w, factor_x, scale->filter);
+    scale_axis_init(&scale->y, src_h, dst_h, factor_y, scale->filter);
+
+    #if DEBUG
+        printf(
+            "Scaling %dx%d to %dx%d at %d,%d, %d by %d taps\n",
+            src_w, src_h, scale->x.length, scale->y.length,
+            scale->x.offset, scale->y.offset, scale->x.taps, scale->y.taps
+        );
+    #endif
+
+    return SUCC_OUT;
+}
+
+void scale_free(struct scale *scale) {
+    free(scale->x.first);
+    free(scale->x.weight);
+    free(scale->y.first);
+    free(scale->y.weight);
+}
+
+static uint8_t scale_nearest_color(
+    const uint8_t *ct, uint8_t max_ct_color,
+    uint8_t has_transparency, uint8_t transparent_index,
+    const uint8_t *color
+) {
+    /* Index of the closest color in ct (RGB, 3 bytes per color), by squared
+       distance */
+
+    uint32_t best_distance = UINT32_MAX;
+    uint32_t distance;
+    int32_t d;
+    uint8_t best = transparent_index;
+    uint16_t i;
+    uint8_t c;
+
+    for (i = 0; i <= max_ct_color; ++i) {
+        if (has_transparency && i == transparent_index) {
+            continue;
+        }
+        distance = 0;
+        for (c = 0; c < 3; ++c) {
+            d = (int32_t) ct[i * 3 + c] - color[c];
+            distance += d * d;
+        }
+        if (distance < best_distance) {
+            best_distance = distance;
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+#if !SCALE_HAS_SSE2
+static void scale_row_scalar(
+    const struct scale_axis *x,
+    const uint8_t rgba[256][4],
+    const uint8_t *src_row,
+    uint16_t *out
+) {
+    /* One source row scaled horizontally into x->length RGBA values */
+
+    const uint16_t *weights;
+    const uint8_t *pixel;
+    uint32_t acc[4];
+    uint16_t o, k;
+    uint8_t c;
+
+    for (o = 0; o < x->length; ++o, out += 4) {
+        weights = x->weight + o * x->taps;
+        acc[0] = acc[1] = acc[2] = acc[3] = 0;
+        for (k = 0; k < x->taps; ++k) {
+            pixel = rgba[src_row[x->first[o] + k]];
+            for (c = 0; c < 4; ++c) {
+                acc[c] += weights[k] * pixel[c];
+            }
+        }
+        for (c = 0; c < 4; ++c) {
+            out[c] = (acc[c] + 8) >> 4;
+        }
+    }
+}
+#endif
+
+#if SCALE_HAS_SSE2
+static void scale_row_sse2(
+    const struct scale_axis *x,
+    const uint8_t rgba[256][4],
+    const uint8_t *src_row,
+    uint16_t *out
+) {
+    /* Same as scale_row_scalar, two taps at a time: their RGBA interleaved
+       as 16-bit pairs, so one madd weighs and sums both for all channels */
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(8);
+    const uint16_t *weights;
+    const uint8_t *pixels;
+    __m128i acc, a, b;
+    int32_t value;
+    uint16_t o, k;
+
+    for (o = 0; o < x->length; ++o, out += 4) {
+        weights = x->weight + o * x->taps;
+        pixels = src_row + x->first[o];
+        acc = zero;
+        for (k = 0; k < x->taps; k += 2) {
+            memcpy(&value, rgba[pixels[k]], 4);
+            a = _mm_cvtsi32_si128(value);
+            if (k + 1 < x->taps) {
+                memcpy(&value, rgba[pixels[k + 1]], 4);
+                b = _mm_cvtsi32_si128(value);
+                value = weights[k] | (int32_t) weights[k + 1] << 16;
+            }
+            else {
+                b = zero;
+                value = weights[k];
+            }
+            a = _mm_unpacklo_epi8(_mm_unpacklo_epi8(a, b), zero);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(a, _mm_set1_epi32(value)));
+        }
+
+        /* Results fit 16 bits, sign extended so packs keeps them as is */
+        acc = _mm_srli_epi32(_mm_add_epi32(acc, round), 4);
+        acc = _mm_srai_epi32(_mm_slli_epi32(acc, 16), 16);
+        _mm_storel_epi64((__m128i *) out, _mm_packs_epi32(acc, acc));
+    }
+}
+#endif
+
+void scale_frame(
+    const struct scale *scale,
+    const uint8_t *ct, uint8_t max_ct_color,
+    uint8_t has_transparency, uint8_t transparent_index,
+    uint8_t fill_index,
+    const uint8_t *src,
+    uint8_t *dst
+) {
+    /* Resample src (src_w * src_h color indices) into dst (dst_w * dst_h).
+       Nearest copies indices, the other filters run separably over RGBA,
+       rows first, then map each pixel back to the closest color in ct.
+       Pixels that come out mostly transparent stay transparent, ones outside
+       the scaled image take fill_index */
+
+    const struct scale_axis *x = &scale->x;
+    const struct scale_axis *y = &scale->y;
+    uint8_t rgba[256][4];
+    uint16_t *rows;  /* Rows scaled horizontally, 8 fractional bits */
+    uint32_t *row_slots;  /* Per source row, its place in rows if any output row reads it */
+    uint32_t row_count = 0;
+    uint32_t *line;  /* One output row, SCALE_WEIGHT_BITS + 8 fractional bits */
+    uint32_t *cache_keys;  /* Nearest color by RGB, open addressed */
+    uint8_t *cache_values;
+    const uint8_t *src_row;
+    const uint16_t *row;
+    uint8_t *out;
+    uint32_t acc[4];
+    uint32_t i, key, slot;
+    uint16_t o, k, weight;
+    uint8_t c;
+    uint8_t color[4];
+    size_t line_values = x->length * 4;
+
+    if (x->length < scale->dst_w || y->length < scale->dst_h) {
+        memset(dst, fill_index, scale->dst_w * scale->dst_h);
+    }
+
+    if (scale->filter == SCALE_NEAREST) {
+        for (o = 0; o < y->length; ++o) {
+            src_row = src + y->first[o] * scale->src_w;
+            out = dst + (y->offset + o) * scale->dst_w + x->offset;
+            for (i = 0; i < x->length; ++i) {
+                out[i] = src_row[x->first[i]];
+            }
+        }
+        return;
+    }
+
+    for (i = 0; i < 256; ++i) {
+        rgba[i][0] = ct[i * 3];
+        rgba[i][1] = ct[i * 3 + 1];
+        rgba[i][2] = ct[i * 3 + 2];
+        rgba[i][3] = 255;
+    }
+    if (has_transparency) {
+        /* Transparent pixels add nothing, so colors sum premultiplied */
+        memset(rgba[transparent_index], 0, 4);
+    }
+
+    row_slots = (uint32_t *) malloc(scale->src_h * sizeof(uint32_t));
+    memset(row_slots, 0xFF, scale->src_h * sizeof(uint32_t));
+    for (o = 0; o < y->length; ++o) {
+        for (k = 0; k < y->taps; ++k) {
+            if (row_slots[y->first[o] + k] == UINT32_MAX) {
+                row_slots[y->first[o] + k] = row_count++;
+            }
+        }
+    }
+
+    rows = (uint16_t *) malloc(row_count * line_values * sizeof(uint16_t));
+    line = (uint32_t *) malloc(line_values * sizeof(uint32_t));
+    cache_keys = (uint32_t *) calloc(SCALE_CACHE_SIZE, sizeof(uint32_t));
+    cache_values = (uint8_t *) malloc(SCALE_CACHE_SIZE);
+
+    /* Horizontal pass, over the source rows some output row reads */
+    for (i = 0; i < scale->src_h; ++i) {
+        if (row_slots[i] == UINT32_MAX) {
+            continue;
+        }
+        #if SCALE_HAS_SSE2
+            scale_row_sse2(x, (const uint8_t (*)[4]) rgba, src + i * scale->src_w, rows + row_slots[i] * line_values);
+        #else
+            scale_row_scalar(x, (const uint8_t (*)[4]) rgba, src + i * scale->src_w, rows + row_slots[i] * line_values);
+        #endif
+    }
+
+    /* Vertical pass, whole rows at a time */
+    for (o = 0; o < y->length; ++o) {
+        memset(line, 0, line_values * sizeof(uint32_t));
+        for (k = 0; k < y->taps; ++k) {
+            weight = y->weight[o * y->taps + k];
+            row = rows + row_slots[y->first[o] + k] * line_values;
+            for (i = 0; i < line_values; ++i) {
+                line[i] += weight * row[i];
+            }
+        }
+
+        out = dst + (y->offset + o) * scale->dst_w + x->offset;
+        for (i = 0; i < x->length; ++i) {
+            for (c = 0; c < 4; ++c) {
+                acc[c] = (line[i * 4 + c] + (1U << (SCALE_WEIGHT_BITS + 7))) >> (SCALE_WEIGHT_BITS + 8);
+            }
+            if (has_transparency && acc[3] < 128) {
+                out[i] = transparent_index;
+                continue;
+            }
+            for (c = 0; c < 3; ++c) {
+                acc[c] = acc[3] < 255 ? acc[c] * 255 / acc[3] : acc[c];
+                color[c] = acc[c] > 255 ? 255 : acc[c];
+            }
+
+            /* Each distinct color is only searched for once */
+            key = SCALE_CACHE_USED | (uint32_t) color[0] << 16 | color[1] << 8 | color[2];
+            slot = (key * 2654435761U) >> 18;
+            while (cache_keys[slot] && cache_keys[slot] != key) {
+                slot = (slot + 1) & (SCALE_CACHE_SIZE - 1);
+            }
+            if (!cache_keys[slot]) {
+                cache_keys[slot] = key;
+                cache_values[slot] = scale_nearest_color(ct, max_ct_color, has_transparency, transparent_index, color);
+            }
+            out[i] = cache_values[slot];
+        }
+    }
+
+    free(row_slots);
+    free(rows);
+    free(line);
+    free(cache_keys);
+    free(cache_values);
+}
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "show.h"
+
+int show_open(struct show *show, const char *filename) {
+    /* Map a show file and check that everything it points at is inside it */
+
+    const struct show_header *header;
+    size_t payload_size = (size_t) CHUNK_LEDS * DATA_BYTES;
+    uint32_t i;
+
+    if (file_map_open(&show->input, filename) == ERROR_OUT) {
+        return ERROR_OUT;
+    }
+    header = (const struct show_header *) show->input.data;
+    show->header = header;
+
+    if (show->input.size < sizeof(struct show_header) ||
+        memcmp(header->magic, SHOW_MAGIC, sizeof(header->magic))) {
+        printf("Error: Not a show file\n");
+        goto error;
+    }
+    if (header->version != SHOW_VERSION) {
+        printf("Error: Unsupported show version %u\n", header->version);
+        goto error;
+    }
+    if (header->leds != CHUNK_LEDS || header->payload_bytes != DATA_BYTES) {
+        printf("Error: Show was compiled for a different floor layout\n");
+        goto error;
+    }
+    if (!header->frame_count || !header->payload_count) {
+        printf("Error: Show has no frames\n");
+        goto error;
+    }
+    if (header->frames_offset % sizeof(uint32_t) ||
+        header->frames_offset > show->input.size ||
+        (show->input.size - header->frames_offset) / sizeof(struct show_frame) < header->frame_count ||
+        header->payloads_offset > show->input.size ||
+        (show->input.size - header->payloads_offset) / payload_size < header->payload_count) {
+        printf("Error: Show file is truncated\n");
+        goto error;
+    }
+
+    show->frames = (const struct show_frame *) (show->input.data + header->frames_offset);
+    show->payloads = show->input.data + header->payloads_offset;
+
+    for (i = 0; i < header->frame_count; ++i) {
+        if (show->frames[i].payload >= header->payload_count) {
+            printf("Error: Show frame %u has an invalid payload\n", i);
+            goto error;
+        }
+    }
+
+    return SUCC_OUT;
+
+error:
+    file_map_close(&show->input);
+    return ERROR_OUT;
+}
+
+const uint8_t *show_payload(struct show *show, size_t frame_index, uint16_t led_index) {
+    /* DATA_BYTES of packet data for one LED index of a frame */
+    return show->payloads +
+        ((size_t) show->frames[frame_index].payload * CHUNK_LEDS + led_index) * DATA_BYTES;
+}
+
+void show_fill(struct show *show, size_t frame_index, struct packet_set *set) {
+    /* Copy a frame's payloads into a packet set made with packet_set_init */
+
+    uint16_t i;
+
+    for (i = 0; i < CHUNK_LEDS; ++i) {
+        memcpy(
+            set->packets[i] + HEADER_BYTES + LED_INDEX_BYTES,
+            show_payload(show, frame_index, i),
+            DATA_BYTES
+        );
+    }
+}
+
+void show_close(struct show *show) {
+    file_map_close(&show->input);
+}
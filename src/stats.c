@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/mman.h>
+
+#include "global_defines.h"
+#include "stats.h"
+#include "timing.h"
+
+static struct stats local_stats;
+
+struct stats *stats = &local_stats;
+
+const char *stats_stage_names[STATS_STAGES] = {"compose", "packetize", "send", "pace", "refresh"};
+const char *stats_counter_names[STATS_COUNTERS] = {"send_errors", "send_again", "frames_missed"};
+
+int stats_open(const char *path) {
+    /* Record into a shared memory segment at path from now on. The segment
+       is left in place on exit, so it can be read after a crash */
+
+    int fd;
+    struct stats *segment;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        perror("Error [open stats]");
+        return ERROR_OUT;
+    }
+    if (ftruncate(fd, sizeof(struct stats)) < 0) {
+        perror("Error [ftruncate stats]");
+        close(fd);
+        return ERROR_OUT;
+    }
+    segment = (struct stats *) mmap(0, sizeof(struct stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        perror("Error [mmap stats]");
+        return ERROR_OUT;
+    }
+
+    /* Fresh segment is zeroed, so only the header is written */
+    memcpy(segment->magic, STATS_MAGIC, sizeof(segment->magic));
+    segment->version = STATS_VERSION;
+    segment->pid = getpid();
+    segment->started = time_now_ns();
+    stats = segment;
+
+    return SUCC_OUT;
+}
+
+void stats_close(void) {
+    /* Only once no other thread records */
+
+    if (stats != &local_stats) {
+        munmap(stats, sizeof(struct stats));
+        stats = &local_stats;
+    }
+}
+
+uint16_t stats_bucket(uint64_t ns) {
+    uint8_t exponent;
+
+    if (ns < STATS_SUB_BUCKETS) {
+        return ns;
+    }
+    exponent = 63 - __builtin_clzll(ns);
+
+    return (exponent - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS +
+        ((ns >> (exponent - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+}
+
+uint64_t stats_bucket_max(uint16_t bucket) {
+    /* Largest value counted in bucket */
+
+    uint8_t shift;
+
+    if (bucket < STATS_SUB_BUCKETS) {
+        return bucket;
+    }
+    shift = bucket / STATS_SUB_BUCKETS - 1;
+
+    return (((uint64_t) (STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS)) << shift) + ((1ULL << shift) - 1);
+}
+
+void stats_record(enum stats_stage stage, uint64_t ns) {
+    /* Each stage is recorded by a single thread, the atomics are for readers */
+
+    struct stats_histogram *histogram = &stats->histograms[stage];
+
+    __atomic_fetch_add(&histogram->buckets[stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    if (ns > __atomic_load_n(&histogram->max, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&histogram->max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_count(enum stats_counter counter, uint64_t n) {
+    __atomic_fetch_add(&stats->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_percentile(const struct stats_histogram *histogram, double fraction) {
+    /* Upper bound of the bucket holding the given fraction of values, 0 if
+       there are none */
+
+    uint64_t total = 0;
+    uint64_t seen = 0;
+    uint64_t target;
+    uint16_t i;
+
+    for (i = 0; i < STATS_BUCKETS; ++i) {
+        total += histogram->buckets[i];
+    }
+    if (!total) {
+        return 0;
+    }
+    target = ceil(fraction * total);
+    target = target ? target : 1;
+
+    for (i = 0; i < STATS_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if (seen >= target) {
+            break;
+        }
+    }
+
+    /* Top bucket is often much wider than what was actually recorded */
+    return histogram->max && histogram->max < stats_bucket_max(i) ? histogram->max : stats_bucket_max(i);
+}
@@ -0,0 +1,115 @@
+#include "stream.h"
+
+static void *gif_stream_thread_func(void *args) {
+    /* Decode frames in playback order, looping back to the start, for as long
+       as there is a free slot in the ring */
+
+    struct gif_stream *stream = (struct gif_stream *) args;
+    struct frame *frame;
+    size_t frame_index;
+    uint8_t *slot;
+
+    while (1) {
+        pthread_mutex_lock(&stream->lock);
+        while (!stream->stop && stream->decoded - stream->released == STREAM_SLOTS) {
+            pthread_cond_wait(&stream->cond, &stream->lock);
+        }
+        if (stream->stop) {
+            pthread_mutex_unlock(&stream->lock);
+            break;
+        }
+        frame_index = stream->decoded % stream->gif->frames.length;
+        slot = stream->slots[stream->decoded % STREAM_SLOTS];
+        pthread_mutex_unlock(&stream->lock);
+
+        /* Slot is owned by this thread until decoded is bumped */
+        frame = (struct frame *) dyn_arr_get(&stream->gif->frames, frame_index);
+        gif_decode_frame(stream->gif, frame, slot);
+
+        pthread_mutex_lock(&stream->lock);
+        ++stream->decoded;
+        pthread_cond_broadcast(&stream->cond);
+        pthread_mutex_unlock(&stream->lock);
+    }
+
+    return 0;
+}
+
+int gif_stream_start(struct gif_stream *stream, struct gif *gif) {
+    /* Start decoding frames of a GIF loaded with lazy_decode set */
+
+    uint8_t i;
+
+    if (!gif->frames.length) {
+        printf("Error: GIF has no frames to stream\n");
+        return ERROR_OUT;
+    }
+
+    stream->gif = gif;
+    stream->decoded = 0;
+    stream->consumed = 0;
+    stream->released = 0;
+    stream->stop = 0;
+
+    for (i = 0; i < STREAM_SLOTS; ++i) {
+        stream->slots[i] = (uint8_t *) malloc(gif->w * gif->h);
+    }
+
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->cond, NULL);
+    if (pthread_create(&stream->thread, NULL, gif_stream_thread_func, stream) != 0) {
+        printf("Error: Could not start stream decoder thread\n");
+        pthread_mutex_destroy(&stream->lock);
+        pthread_cond_destroy(&stream->cond);
+        for (i = 0; i < STREAM_SLOTS; ++i) {
+            free(stream->slots[i]);
+        }
+        return ERROR_OUT;
+    }
+
+    return SUCC_OUT;
+}
+
+uint8_t *gif_stream_next(struct gif_stream *stream, size_t *frame_index) {
+    /* Release the frame returned by the previous call and return the next
+       one, waiting for it to be decoded if the decoder has fallen behind */
+
+    uint8_t *slot;
+
+    pthread_mutex_lock(&stream->lock);
+
+    stream->released = stream->consumed;
+    pthread_cond_broadcast(&stream->cond);
+
+    while (stream->decoded == stream->consumed) {
+        pthread_cond_wait(&stream->cond, &stream->lock);
+    }
+
+    if (frame_index) {
+        *frame_index = stream->consumed % stream->gif->frames.length;
+    }
+    slot = stream->slots[stream->consumed % STREAM_SLOTS];
+    ++stream->consumed;
+
+    pthread_mutex_unlock(&stream->lock);
+
+    return slot;
+}
+
+void gif_stream_stop(struct gif_stream *stream) {
+    uint8_t i;
+
+    pthread_mutex_lock(&stream->lock);
+    stream->stop = 1;
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->lock);
+
+    pthread_join(stream->thread, NULL);
+
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->cond);
+
+    for (i = 0; i < STREAM_SLOTS; ++i) {
+        free(stream->slots[i]);
+    }
+}
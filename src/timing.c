@@ -0,0 +1,213 @@
+#include <time.h>
+#include <math.h>
+
+#include "timing.h"
+
+uint64_t time_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void time_wait_until(uint64_t deadline, uint64_t spin) {
+    /* Sleep until shortly before deadline, then spin the rest of the way,
+       since sleeps overshoot by the timer slack and wakeup latency */
+
+    struct timespec ts;
+    uint64_t now = time_now_ns();
+
+    if (now >= deadline) {
+        return;
+    }
+
+    if (deadline - now > spin) {
+        ts.tv_sec = (deadline - spin) / 1000000000ULL;
+        ts.tv_nsec = (deadline - spin) % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0)) {
+            /* Interrupted by a signal, sleep the rest */
+        }
+    }
+
+    while (time_now_ns() < deadline) {
+        #if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+        #endif
+    }
+}
+
+void interval_stats_reset(struct interval_stats *stats) {
+    stats->count = 0;
+    stats->min = UINT64_MAX;
+    stats->max = 0;
+    stats->sum = 0;
+    stats->sum_sq = 0;
+}
+
+void interval_stats_add(struct interval_stats *stats, uint64_t interval) {
+    ++stats->count;
+    if (interval < stats->min) {
+        stats->min = interval;
+    }
+    if (interval > stats->max) {
+        stats->max = interval;
+    }
+    stats->sum += interval;
+    stats->sum_sq += (double) interval * interval;
+}
+
+void pacer_init(struct pacer *pacer, uint64_t gap, uint64_t refresh) {
+    pacer->gap = gap;
+    pacer->refresh = refresh;
+    pacer->spin = 0;
+    pacer->next_batch = 0;
+    pacer->next_refresh = 0;
+    pacer->last_batch = 0;
+    pacer->last_refresh = 0;
+    pacer->is_refresh_start = 0;
+    interval_stats_reset(&pacer->gaps);
+    interval_stats_reset(&pacer->refreshes);
+}
+
+void pacer_calibrate(struct pacer *pacer) {
+    /* Measure how late short absolute sleeps wake up, waits shorter than
+       the worst case are spun instead */
+
+    uint64_t deadline;
+    uint64_t late;
+    uint8_t i;
+
+    pacer->spin = 0;
+    for (i = 0; i < PACER_CALIBRATE_SLEEPS; ++i) {
+        deadline = time_now_ns() + PACER_CALIBRATE_SLEEP_NS;
+        time_wait_until(deadline, 0);
+        late = time_now_ns() - deadline;
+        if (late > pacer->spin) {
+            pacer->spin = late;
+        }
+    }
+}
+
+void pacer_wait_refresh(struct pacer *pacer) {
+    /* Hold the first batch of a refresh until the refresh deadline */
+
+    uint64_t now;
+
+    if (pacer->refresh) {
+        now = time_now_ns();
+        if (pacer->next_refresh + pacer->refresh < now) {
+            /* More than a whole period behind, restart the schedule */
+            pacer->next_refresh = now;
+        }
+        if (pacer->next_batch < pacer->next_refresh) {
+            pacer->next_batch = pacer->next_refresh;
+        }
+        pacer->next_refresh += pacer->refresh;
+    }
+
+    pacer->is_refresh_start = 1;
+}
+
+void pacer_wait_batch(struct pacer *pacer) {
+    /* Wait for the batch deadline, then schedule the next batch one gap
+       after this deadline so wakeup delays do not add up */
+
+    uint64_t now;
+
+    if (pacer->gap || pacer->refresh) {
+        time_wait_until(pacer->next_batch, pacer->spin);
+    }
+    now = time_now_ns();
+
+    if (pacer->last_batch && !(pacer->refresh && pacer->is_refresh_start)) {
+        /* Idle time before a paced refresh is not a packet gap */
+        interval_stats_add(&pacer->gaps, now - pacer->last_batch);
+    }
+    pacer->last_batch = now;
+
+    if (pacer->is_refresh_start) {
+        if (pacer->last_refresh) {
+            interval_stats_add(&pacer->refreshes, now - pacer->last_refresh);
+        }
+        pacer->last_refresh = now;
+        pacer->is_refresh_start = 0;
+    }
+
+    pacer->next_batch += pacer->gap;
+    if (pacer->next_batch < now + pacer->gap / 2) {
+        /* Woke up late, never squeeze the next gap below half the target */
+        pacer->next_batch = now + pacer->gap / 2;
+    }
+}
+
+void pacer_report(struct pacer *pacer, FILE *file) {
+    /* Print achieved gap and jitter since the last report, then reset */
+
+    struct interval_stats *gaps = &pacer->gaps;
+    struct interval_stats *refreshes = &pacer->refreshes;
+    double mean;
+    double jitter;
+
+    if (gaps->count) {
+        mean = gaps->sum / gaps->count;
+        jitter = sqrt(fmax(gaps->sum_sq / gaps->count - mean * mean, 0));
+        fprintf(
+            file,
+            "Gap: %.2f us (target %.2f, jitter %.2f, min %.2f, max %.2f) ",
+            mean / 1000, pacer->gap / 1000.0, jitter / 1000,
+            gaps->min / 1000.0, gaps->max / 1000.0
+        );
+    }
+    if (refreshes->count) {
+        mean = refreshes->sum / refreshes->count;
+        jitter = sqrt(fmax(refreshes->sum_sq / refreshes->count - mean * mean, 0));
+        fprintf(
+            file,
+            "Refresh: %.1f Hz (jitter %.2f us, max %.2f us)",
+            1e9 / mean, jitter / 1000, refreshes->max / 1000.0
+        );
+    }
+    fprintf(file, "\n");
+
+    interval_stats_reset(gaps);
+    interval_stats_reset(refreshes);
+}
+
+void frame_clock_start(struct frame_clock *clock, uint64_t now, uint16_t delay) {
+    /* Frame with the given delay goes up at now. Counters carry on, so
+       they must start out zeroed */
+    clock->next = now + delay * FRAME_DELAY_NS;
+    __atomic_fetch_add(&clock->shown, 1, __ATOMIC_RELAXED);
+}
+
+uint8_t frame_clock_advance(struct frame_clock *clock, uint64_t now, uint16_t delay) {
+    /* Account for a frame with the given delay starting at its ideal time.
+       Return 1 if the frame is due to be shown, 0 if its whole slot has
+       already passed and it should be skipped */
+
+    clock->next += delay * FRAME_DELAY_NS;
+
+    if (now >= clock->next && delay) {
+        __atomic_fetch_add(&clock->skipped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    if (now > clock->next + FRAME_CLOCK_RESYNC_NS) {
+        /* Far behind, e.g. after a run of zero delay frames, start over */
+        clock->next = now;
+    }
+
+    __atomic_fetch_add(&clock->shown, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void frame_clock_report(struct frame_clock *clock, FILE *file) {
+    /* May run on a different thread than frame_clock_advance */
+    uint64_t shown = __atomic_exchange_n(&clock->shown, 0, __ATOMIC_RELAXED);
+    uint64_t skipped = __atomic_exchange_n(&clock->skipped, 0, __ATOMIC_RELAXED);
+
+    fprintf(
+        file, "Frames: %llu shown, %llu skipped. ",
+        (unsigned long long) shown, (unsigned long long) skipped
+    );
+}
@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <netinet/ether.h>
+#include <sys/un.h>
+
+#include "tx.h"
+#include "stats.h"
+
+static uint8_t tx_is_transient(const struct tx *tx) {
+    /* Whether the last send failed only for lack of buffer space, or a
+       datagram sink's receiver not listening. Such packets are dropped and
+       counted rather than stopping the floor. A UNIX socket path is gone
+       or refuses while its receiver is not running */
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == ECONNREFUSED) {
+        return 1;
+    }
+    return tx->mode == TX_UNIX && (errno == ENOENT || errno == ENOTCONN);
+}
+
+int tx_parse_mode(enum tx_mode *mode, const char **target, const char *name) {
+    /* Mode given as sendto, mmsg, ring, null, pcap:<file>, udp:<host>:<port>
+       or unix:<path>. target is set to what follows the colon, if any */
+
+    const char *colon = strchr(name, ':');
+    size_t name_length = colon ? (size_t) (colon - name) : strlen(name);
+
+    if (name_length == 6 && !strncmp(name, "sendto", 6)) {
+        *mode = TX_SENDTO;
+    }
+    else if (name_length == 4 && !strncmp(name, "mmsg", 4)) {
+        *mode = TX_MMSG;
+    }
+    else if (name_length == 4 && !strncmp(name, "ring", 4)) {
+        *mode = TX_RING;
+    }
+    else if (name_length == 4 && !strncmp(name, "null", 4)) {
+        *mode = TX_NULL;
+    }
+    else if (name_length == 4 && !strncmp(name, "pcap", 4)) {
+        *mode = TX_PCAP;
+    }
+    else if (name_length == 3 && !strncmp(name, "udp", 3)) {
+        *mode = TX_UDP;
+    }
+    else if (name_length == 4 && !strncmp(name, "unix", 4)) {
+        *mode = TX_UNIX;
+    }
+    else {
+        printf("Error: Unknown transmit mode %s\n", name);
+        return ERROR_OUT;
+    }
+
+    if (*mode >= TX_PCAP && (!colon || !colon[1])) {
+        printf("Error: Transmit mode %.*s needs a target\n", (int) name_length, name);
+        return ERROR_OUT;
+    }
+    if (*mode < TX_PCAP && colon) {
+        printf("Error: Transmit mode %.*s takes no target\n", (int) name_length, name);
+        return ERROR_OUT;
+    }
+    if (colon) {
+        *target = colon + 1;
+    }
+
+    return SUCC_OUT;
+}
+
+static void tx_set_header(struct tx *tx, const uint8_t *source_mac) {
+    /* Construct Ethernet header */
+
+    struct ether_header *eth_head = (struct ether_header *) tx->header;
+    uint16_t i;
+
+    for (i = 0; i < 6; ++i) {
+        eth_head->ether_shost[i] = source_mac[i];
+
+        /* Local MAC address, should match what FPGA is expecting */
+        if (i == 0) {
+            eth_head->ether_dhost[i] = 0x02;
+            tx->address.sll_addr[i] = 0x02;
+        }
+        else {
+            eth_head->ether_dhost[i] = 0x00;
+            tx->address.sll_addr[i] = 0x00;
+        }
+    }
+    eth_head->ether_type = htons(ETH_P_IP);
+}
+
+static void tx_init_msgs(struct tx *tx, void *name, socklen_t name_length) {
+    /* Message headers for sendmmsg, packets are pointed to per send */
+
+    uint16_t i;
+
+    memset(tx->msgs, 0, sizeof(tx->msgs));
+    for (i = 0; i < CHUNK_LEDS; ++i) {
+        tx->iovs[i].iov_len = FRAME_BYTES;
+        tx->msgs[i].msg_hdr.msg_name = name;
+        tx->msgs[i].msg_hdr.msg_namelen = name_length;
+        tx->msgs[i].msg_hdr.msg_iov = &tx->iovs[i];
+        tx->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+static int tx_open_pcap(struct tx *tx, const char *path) {
+    /* Create a pcap file and write its global header */
+
+    uint32_t header[6];
+    uint16_t i;
+
+    if ((tx->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        perror("Error [open pcap]");
+        return ERROR_OUT;
+    }
+
+    header[0] = TX_PCAP_MAGIC;
+    header[1] = 2 | (4 << 16);  /* Version 2.4 */
+    header[2] = 0;  /* Timezone offset */
+    header[3] = 0;  /* Timestamp accuracy */
+    header[4] = TX_PCAP_SNAPLEN;
+    header[5] = TX_PCAP_LINKTYPE_ETHERNET;
+    if (write(tx->fd, header, sizeof(header)) != sizeof(header)) {
+        perror("Error [write pcap]");
+        return ERROR_OUT;
+    }
+
+    for (i = 0; i < CHUNK_LEDS; ++i) {
+        tx->records[i].incl_len = FRAME_BYTES;
+        tx->records[i].orig_len = FRAME_BYTES;
+        tx->pcap_iovs[2 * i].iov_base = &tx->records[i];
+        tx->pcap_iovs[2 * i].iov_len = sizeof(struct tx_pcap_record);
+        tx->pcap_iovs[2 * i + 1].iov_len = FRAME_BYTES;
+    }
+
+    return SUCC_OUT;
+}
+
+static int tx_open_datagram(struct tx *tx, const char *target) {
+    /* Connect a datagram socket to host:port (TX_UDP), so sends need no
+       address, or address every send to a socket path (TX_UNIX), so the
+       receiver may start after the player and restart while it runs.
+       Non-blocking, so a slow receiver costs packets rather than stalling
+       refreshes */
+
+    struct sockaddr_un *address = &tx->unix_address;
+    struct addrinfo hints;
+    struct addrinfo *result;
+    char host[256];
+    const char *port;
+    int status;
+
+    if (tx->mode == TX_UNIX) {
+        if (strlen(target) >= sizeof(address->sun_path)) {
+            printf("Error: Socket path too long\n");
+            return ERROR_OUT;
+        }
+        memset(address, 0, sizeof(struct sockaddr_un));
+        address->sun_family = AF_UNIX;
+        strcpy(address->sun_path, target);
+
+        if ((tx->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) {
+            perror("Error [socket]");
+            return ERROR_OUT;
+        }
+        tx_init_msgs(tx, address, sizeof(struct sockaddr_un));
+        return SUCC_OUT;
+    }
+    else {
+        if (!(port = strrchr(target, ':')) || (size_t) (port - target) >= sizeof(host)) {
+            printf("Error: UDP target must be given as host:port\n");
+            return ERROR_OUT;
+        }
+        memcpy(host, target, port - target);
+        host[port - target] = 0;
+        ++port;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        if ((status = getaddrinfo(host, port, &hints, &result)) != 0) {
+            printf("Error: Could not resolve %s: %s\n", target, gai_strerror(status));
+            return ERROR_OUT;
+        }
+        if ((tx->fd = socket(result->ai_family, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) {
+            perror("Error [socket]");
+            freeaddrinfo(result);
+            return ERROR_OUT;
+        }
+        status = connect(tx->fd, result->ai_addr, result->ai_addrlen);
+        freeaddrinfo(result);
+        if (status < 0) {
+            perror("Error [connect]");
+            return ERROR_OUT;
+        }
+    }
+
+    tx_init_msgs(tx, 0, 0);
+
+    return SUCC_OUT;
+}
+
+static int tx_open_ring(struct tx *tx) {
+    /* Map a TPACKET_V2 TX ring large enough for a full refresh */
+
+    int version = TPACKET_V2;
+    struct tpacket_req req;
+
+    if (setsockopt(tx->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        perror("Error [PACKET_VERSION]");
+        return ERROR_OUT;
+    }
+
+    req.tp_frame_size = TX_RING_FRAME_SIZE;
+    req.tp_block_size = TX_RING_BLOCK_SIZE;
+    req.tp_block_nr = (CHUNK_LEDS * TX_RING_FRAME_SIZE + TX_RING_BLOCK_SIZE - 1) / TX_RING_BLOCK_SIZE;
+    req.tp_frame_nr = req.tp_block_nr * (TX_RING_BLOCK_SIZE / TX_RING_FRAME_SIZE);
+
+    if (setsockopt(tx->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+        perror("Error [PACKET_TX_RING]");
+        return ERROR_OUT;
+    }
+
+    tx->ring_size = (size_t) req.tp_block_nr * req.tp_block_size;
+    tx->ring_frames = req.tp_frame_nr;
+    tx->ring_index = 0;
+    tx->ring = (uint8_t *) mmap(0, tx->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, tx->fd, 0);
+    if (tx->ring == MAP_FAILED) {
+        perror("Error [mmap TX ring]");
+        tx->ring = 0;
+        return ERROR_OUT;
+    }
+
+    /* Ring sends go to the bound interface */
+    if (bind(tx->fd, (struct sockaddr *) &tx->address, sizeof(struct sockaddr_ll)) < 0) {
+        perror("Error [bind]");
+        return ERROR_OUT;
+    }
+
+    return SUCC_OUT;
+}
+
+int tx_open(struct tx *tx, enum tx_mode mode, const char *target) {
+    /* target is the interface name for raw socket modes, what follows the
+       colon in the mode otherwise */
+
+    const char *interface_name = target;
+    struct ifreq interface_id;
+    struct ifreq interface_mac;
+    static const uint8_t no_mac[6];
+
+    tx->mode = mode;
+    tx->fd = -1;
+    tx->ring = 0;
+    memset(tx->header, 0, HEADER_BYTES);
+    memset(&tx->address, 0, sizeof(struct sockaddr_ll));
+
+    if (mode >= TX_NULL) {
+        /* Packets look as they would on the link, without a sender MAC */
+        tx_set_header(tx, no_mac);
+        if (mode == TX_PCAP) {
+            return tx_open_pcap(tx, target);
+        }
+        if (mode == TX_UDP || mode == TX_UNIX) {
+            return tx_open_datagram(tx, target);
+        }
+        return SUCC_OUT;
+    }
+
+    if ((tx->fd = socket(AF_PACKET, SOCK_RAW, IPPROTO_RAW)) == -1) {
+        perror("Error [socket]");
+        return ERROR_OUT;
+    }
+
+    /* Get interface index from name */
+    memset(&interface_id, 0, sizeof(struct ifreq));
+    strncpy(interface_id.ifr_name, interface_name, IFNAMSIZ - 1);
+    if (ioctl(tx->fd, SIOCGIFINDEX, &interface_id) < 0) {
+        perror("Error [SIOCGIFINDEX]");
+        return ERROR_OUT;
+    }
+
+    /* Get sender MAC address */
+    memset(&interface_mac, 0, sizeof(struct ifreq));
+    strncpy(interface_mac.ifr_name, interface_name, IFNAMSIZ - 1);
+    if (ioctl(tx->fd, SIOCGIFHWADDR, &interface_mac) < 0) {
+        perror("Error [SIOCGIFHWADDR]");
+        return ERROR_OUT;
+    }
+    
+    tx_set_header(tx, (uint8_t *) &interface_mac.ifr_hwaddr.sa_data);
+
+    tx->address.sll_family = AF_PACKET;
+    tx->address.sll_ifindex = interface_id.ifr_ifindex;
+    tx->address.sll_halen = ETH_ALEN;
+
+    if (mode == TX_MMSG) {
+        tx_init_msgs(tx, &tx->address, sizeof(struct sockaddr_ll));
+    }
+    else if (mode == TX_RING) {
+        return tx_open_ring(tx);
+    }
+
+    return SUCC_OUT;
+}
+
+static int tx_kick_ring(struct tx *tx) {
+    /* Have the kernel send every frame marked SEND_REQUEST */
+
+    if (sendto(tx->fd, 0, 0, 0, 0, 0) < 0) {
+        if (tx_is_transient(tx)) {
+            /* Queued frames go out with the next kick */
+            stats_count(STATS_SEND_AGAIN, 1);
+            return SUCC_OUT;
+        }
+        stats_count(STATS_SEND_ERRORS, 1);
+        perror("Error [sendto TX ring]");
+        return ERROR_OUT;
+    }
+
+    return SUCC_OUT;
+}
+
+static int tx_send_ring(struct tx *tx, struct packet_set *set, uint16_t first, uint16_t count) {
+    /* Copy packets into ring frames, then hand them all to the kernel at once */
+
+    struct tpacket2_hdr *hdr;
+    struct pollfd pfd;
+    uint16_t i;
+    int ready;
+
+    pfd.fd = tx->fd;
+    pfd.events = POLLOUT;
+
+    for (i = first; i < first + count; ++i) {
+        hdr = (struct tpacket2_hdr *) (tx->ring + (size_t) tx->ring_index * TX_RING_FRAME_SIZE);
+
+        while (hdr->tp_status != TP_STATUS_AVAILABLE) {
+            if (hdr->tp_status == TP_STATUS_WRONG_FORMAT) {
+                printf("Error: TX ring frame rejected by kernel\n");
+                return ERROR_OUT;
+            }
+            /* Kernel is still sending this frame, or never got a kick for
+               it if the last one failed */
+            if (tx_kick_ring(tx) == ERROR_OUT) {
+                return ERROR_OUT;
+            }
+            if ((ready = poll(&pfd, 1, TX_RING_POLL_MS)) < 0) {
+                perror("Error [poll]");
+                return ERROR_OUT;
+            }
+            if (!ready && hdr->tp_status != TP_STATUS_AVAILABLE) {
+                /* Link is stuck, drop the rest of the batch */
+                stats_count(STATS_SEND_AGAIN, 1);
+                return SUCC_OUT;
+            }
+        }
+
+        memcpy(
+            (uint8_t *) hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll),
+            set->packets[i],
+            FRAME_BYTES
+        );
+        hdr->tp_len = FRAME_BYTES;
+        __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+        if (++tx->ring_index == tx->ring_frames) {
+            tx->ring_index = 0;
+        }
+    }
+
+    return tx_kick_ring(tx);
+}
+
+static int tx_send_pcap(struct tx *tx, struct packet_set *set, uint16_t first, uint16_t count) {
+    /* Write a record per packet, all stamped with the time of the batch */
+
+    struct timespec now;
+    uint16_t i;
+    ssize_t bytes = count * (sizeof(struct tx_pcap_record) + FRAME_BYTES);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (i = first; i < first + count; ++i) {
+        tx->records[i].ts_sec = now.tv_sec;
+        tx->records[i].ts_usec = now.tv_nsec / 1000;
+        tx->pcap_iovs[2 * i + 1].iov_base = set->packets[i];
+    }
+
+    if (writev(tx->fd, tx->pcap_iovs + 2 * first, 2 * count) != bytes) {
+        perror("Error [writev pcap]");
+        return ERROR_OUT;
+    }
+
+    return SUCC_OUT;
+}
+
+int tx_send(struct tx *tx, struct packet_set *set, uint16_t first, uint16_t count) {
+    /* Send packets first to first + count - 1 of set */
+
+    uint16_t i;
+    int sent;
+
+    switch (tx->mode) {
+        case TX_SENDTO:
+            for (i = first; i < first + count; ++i) {
+                if (sendto(
+                        tx->fd,
+                        set->packets[i],
+                        FRAME_BYTES,
+                        0,
+                        (struct sockaddr *) &tx->address,
+                        sizeof(struct sockaddr_ll)
+                    ) < 0
+                ) {
+                    if (tx_is_transient(tx)) {
+                        stats_count(STATS_SEND_AGAIN, 1);
+                        continue;
+                    }
+                    stats_count(STATS_SEND_ERRORS, 1);
+                    perror("Error [sendto]");
+                    return ERROR_OUT;
+                }
+            }
+            break;
+
+        case TX_MMSG:
+        case TX_UDP:
+        case TX_UNIX:
+            for (i = first; i < first + count; ++i) {
+                tx->iovs[i].iov_base = set->packets[i];
+            }
+            while (count) {
+                /* sendmmsg may stop short of the full batch */
+                if ((sent = sendmmsg(tx->fd, tx->msgs + first, count, 0)) < 0) {
+                    if (tx_is_transient(tx)) {
+                        /* Drop the packet that failed and send the rest. A
+                           full or absent datagram sink won't take the rest
+                           either */
+                        stats_count(STATS_SEND_AGAIN, 1);
+                        sent = tx->mode == TX_MMSG ? 1 : count;
+                    }
+                    else {
+                        stats_count(STATS_SEND_ERRORS, 1);
+                        perror("Error [sendmmsg]");
+                        return ERROR_OUT;
+                    }
+                }
+                first += sent;
+                count -= sent;
+            }
+            break;
+
+        case TX_RING:
+            return tx_send_ring(tx, set, first, count);
+
+        case TX_PCAP:
+            return tx_send_pcap(tx, set, first, count);
+
+        case TX_NULL:
+            break;
+    }
+
+    return SUCC_OUT;
+}
+
+void tx_close(struct tx *tx) {
+    if (tx->ring) {
+        munmap(tx->ring, tx->ring_size);
+        tx->ring = 0;
+    }
+    if (tx->fd >= 0) {
+        close(tx->fd);
+    }
+}
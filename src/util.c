@@ -1,6 +1,27 @@
+
 #include "util.h"
 
 uint16_t combine_bytes(uint8_t lsb, uint8_t msb) {
     return ((uint16_t) lsb) | (((uint16_t) msb) << 8);
 }
 
+void rect_union(struct rect *rect, const struct rect *other) {
+    /* Grow rect to the bounding box of both */
+
+    uint16_t right, bottom;
+
+    if (!other->w || !other->h) {
+        return;
+    }
+    if (!rect->w || !rect->h) {
+        *rect = *other;
+        return;
+    }
+
+    right = rect->left + rect->w > other->left + other->w ? rect->left + rect->w : other->left + other->w;
+    bottom = rect->top + rect->h > other->top + other->h ? rect->top + rect->h : other->top + other->h;
+    rect->left = rect->left < other->left ? rect->left : other->left;
+    rect->top = rect->top < other->top ? rect->top : other->top;
+    rect->w = right - rect->left;
+    rect->h = bottom - rect->top;
+}
@@ -0,0 +1,518 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "global_defines.h"
+#include "gif.h"
+#include "packet.h"
+#include "color.h"
+#include "compose.h"
+#include "frame_store.h"
+#include "render.h"
+#include "timing.h"
+#include "tx.h"
+
+/* Times the decode, compose and packetize stages over a set of GIFs and
+   checks the decoded ct_indices against golden checksums, so a speedup
+   can't silently change output. Every packet kernel is checked against
+   color_frame_to_eth first, and rendering only what a dirty rect touches
+   against a full render */
+
+#define BENCH_RUNS 10  /* Default times each file is processed */
+#define BENCH_KERNEL_FRAMES 64  /* Random frames each packet kernel is checked on */
+#define BENCH_DIRTY_RECTS 4096  /* Random dirty rects rendered incrementally */
+#define BENCH_DIRTY_SIZE 8  /* Largest of them, small ones find LEDs missed */
+#define BENCH_GOLDEN_LINE 4096
+#define HASH_OFFSET 0xCBF29CE484222325ULL
+#define HASH_PRIME 0x100000001B3ULL
+
+struct samples {
+    uint64_t *values;  /* Unit: ns */
+    size_t length;
+    size_t capacity;
+};
+
+struct color_table colors;
+struct color_frame color_frame;
+struct packet_set packets;
+struct render_buffer render;
+struct tx tx;  /* Null sink */
+uint8_t check_colors[LED_ROWS][LED_COLS][LED_CHANNELS];
+struct packet_set check_packets;
+struct render_buffer check_render;
+
+static const char *kernel_names[] = {"auto", "reference", "scalar", "sse2", "avx2"};
+
+void samples_add(struct samples *samples, uint64_t value) {
+    if (samples->length == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 64;
+        samples->values = (uint64_t *) realloc(samples->values, samples->capacity * sizeof(uint64_t));
+    }
+    samples->values[samples->length++] = value;
+}
+
+int compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+void report(
+    FILE *out,
+    const char *filename,
+    const char *metric,
+    struct samples *samples,
+    double bytes
+) {
+    /* Print median and p99 (us) of samples and clear them. With bytes, the
+       median throughput is printed as well */
+
+    double median, p99;
+
+    if (!samples->length) {
+        return;
+    }
+    qsort(samples->values, samples->length, sizeof(uint64_t), compare_samples);
+    median = samples->values[samples->length / 2] / 1000.0;
+    p99 = samples->values[(samples->length - 1) * 99 / 100] / 1000.0;
+
+    printf("    %-24s median %10.2f us  p99 %10.2f us", metric, median, p99);
+    if (bytes) {
+        printf("  %8.1f MB/s", bytes / median);
+    }
+    printf("\n");
+
+    if (out) {
+        fprintf(
+            out, "%s\t%s\t%.3f\t%.3f\t%lu\t%.3f\t\n",
+            filename, metric, median, p99, (unsigned long) samples->length,
+            bytes ? bytes / median : 0
+        );
+    }
+
+    samples->length = 0;
+}
+
+uint64_t hash_frames(struct gif *gif, uint8_t *ct_indices) {
+    /* Checksum of every frame's ct_indices, for a lazily loaded gif */
+
+    uint64_t hash = HASH_OFFSET;
+    struct frame *frame;
+    size_t i, j;
+    uint32_t pixels = gif->w * gif->h;
+
+    for (i = 0; i < gif->frames.length; ++i) {
+        frame = (struct frame *) dyn_arr_get(&gif->frames, i);
+        gif_decode_frame(gif, frame, ct_indices);
+        for (j = 0; j < pixels; ++j) {
+            hash = (hash ^ ct_indices[j]) * HASH_PRIME;
+        }
+    }
+
+    return hash;
+}
+
+uint8_t kernel_is_supported(int kernel) {
+    /* Whether packet_fill runs kernel itself on this CPU, rather than
+       falling back to another one */
+
+    #if defined(__x86_64__) || defined(__i386__)
+        if (kernel == PACKET_KERNEL_AVX2) {
+            return __builtin_cpu_supports("avx2") != 0;
+        }
+        #if !defined(__SSE2__)
+            if (kernel == PACKET_KERNEL_SSE2) {
+                return 0;
+            }
+        #endif
+        return 1;
+    #else
+        return kernel == PACKET_KERNEL_SCALAR;
+    #endif
+}
+
+int check_kernels(uint16_t frames) {
+    /* Render random frames with every supported kernel and compare all
+       packets byte for byte with color_frame_to_eth. The first frames are
+       all off and all on, to cover every bit set and cleared */
+
+    uint16_t frame, led, row, col, channel;
+    int kernel;
+    int status = SUCC_OUT;
+
+    packet_set_init(&check_packets, tx.header);
+    srand(1);
+
+    for (frame = 0; frame < frames; ++frame) {
+        for (row = 0; row < LED_ROWS; ++row) {
+            for (col = 0; col < LED_COLS; ++col) {
+                for (channel = 0; channel < LED_CHANNELS; ++channel) {
+                    check_colors[row][col][channel] = frame < 2 ? frame * 0xff : (uint8_t) rand();
+                }
+            }
+        }
+        for (led = 0; led < CHUNK_LEDS; ++led) {
+            color_frame_to_eth(packets.packets[led], check_colors, led);
+        }
+
+        for (kernel = PACKET_KERNEL_SCALAR; kernel <= PACKET_KERNEL_AVX2; ++kernel) {
+            if (!kernel_is_supported(kernel)) {
+                continue;
+            }
+            packet_kernel = kernel;
+            packet_set_render(&check_packets, check_colors);
+            for (led = 0; led < CHUNK_LEDS; ++led) {
+                if (memcmp(check_packets.packets[led], packets.packets[led], FRAME_BYTES)) {
+                    printf("Error: Packet kernel %s differs from color_frame_to_eth at frame %d, LED %d\n", kernel_names[kernel], frame, led);
+                    status = ERROR_OUT;
+                    break;
+                }
+            }
+        }
+    }
+    packet_kernel = PACKET_KERNEL_AUTO;
+
+    if (status == SUCC_OUT) {
+        printf("Packet kernels match color_frame_to_eth on %d frames:", frames);
+        for (kernel = PACKET_KERNEL_SCALAR; kernel <= PACKET_KERNEL_AVX2; ++kernel) {
+            if (kernel_is_supported(kernel)) {
+                printf(" %s", kernel_names[kernel]);
+            }
+        }
+        printf("\n");
+    }
+
+    return status;
+}
+
+int check_dirty_rects(uint16_t rects) {
+    /* Change random small rects of a random frame, render them through the
+       render buffer's stale masks and compare every packet with a full
+       render. Every other rect touches the left edge, where pixels are
+       carried by two LEDs. Published sets are taken as the transmit
+       thread would, so all slots are checked */
+
+    struct rect rect;
+    struct packet_set *set;
+    uint16_t i, led, row, col, channel;
+    uint8_t *pixels = &check_colors[0][0][0];
+    uint32_t j;
+
+    render_buffer_init(&check_render, tx.header);
+    srand(2);
+    for (j = 0; j < LED_ROWS * LED_COLS * LED_CHANNELS; ++j) {
+        pixels[j] = (uint8_t) rand();
+    }
+
+    for (i = 0; i < rects; ++i) {
+        rect.left = i % 2 ? 0 : rand() % LED_COLS;
+        rect.top = rand() % LED_ROWS;
+        rect.w = 1 + rand() % (LED_COLS - rect.left < BENCH_DIRTY_SIZE ? LED_COLS - rect.left : BENCH_DIRTY_SIZE);
+        rect.h = 1 + rand() % (LED_ROWS - rect.top < BENCH_DIRTY_SIZE ? LED_ROWS - rect.top : BENCH_DIRTY_SIZE);
+        for (row = rect.top; row < rect.top + rect.h; ++row) {
+            for (col = rect.left; col < rect.left + rect.w; ++col) {
+                for (channel = 0; channel < LED_CHANNELS; ++channel) {
+                    check_colors[row][col][channel] = (uint8_t) rand();
+                }
+            }
+        }
+
+        render_buffer_invalidate(&check_render, &rect);
+        set = render_buffer_render(&check_render, check_colors);
+        packet_set_render(&check_packets, check_colors);
+        for (led = 0; led < CHUNK_LEDS; ++led) {
+            if (memcmp(set->packets[led], check_packets.packets[led], FRAME_BYTES)) {
+                printf(
+                    "Error: Rendering dirty rect %dx%d at %d,%d left LED %d stale\n",
+                    rect.w, rect.h, rect.left, rect.top, led
+                );
+                return ERROR_OUT;
+            }
+        }
+        render_buffer_publish(&check_render, set);
+        render_buffer_front(&check_render, 0);
+    }
+
+    printf("Dirty rect rendering matches full renders on %d rects\n", rects);
+    return SUCC_OUT;
+}
+
+int check_golden(const char *golden_filename, const char *filename, uint64_t hash) {
+    /* Compare hash with the line for filename in the golden file */
+
+    FILE *file = fopen(golden_filename, "r");
+    char line[BENCH_GOLDEN_LINE];
+    char name[BENCH_GOLDEN_LINE];
+    unsigned long long golden;
+
+    if (!file) {
+        perror("Error [fopen golden]");
+        return ERROR_OUT;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "%s %llx", name, &golden) == 2 && !strcmp(name, filename)) {
+            fclose(file);
+            if (golden != hash) {
+                printf("Error: %s decodes to %016llx, golden is %016llx\n", filename, (unsigned long long) hash, golden);
+                return ERROR_OUT;
+            }
+            return SUCC_OUT;
+        }
+    }
+    fclose(file);
+
+    printf("Warning: No golden checksum for %s\n", filename);
+    return SUCC_OUT;
+}
+
+int bench_file(const char *filename, uint16_t runs, const struct scale_options *scaling, FILE *out, uint64_t *hash) {
+    struct gif gif;
+    struct gif lazy_gif;
+    struct frame *frame;
+    struct samples samples = {0, 0, 0};
+    const struct color_lut *lut = &colors.luts[COLOR_LEVELS - 1];
+    uint8_t *canvas;
+    uint8_t *ct_indices;
+    struct packet_set *set;
+    uint8_t is_new;
+    uint64_t start;
+    double file_bytes;
+    size_t i;
+    uint16_t run, led;
+    int kernel;
+    char metric[32];
+
+    /* Lazily loaded copy, to time decoding frame by frame */
+    gif_init(&lazy_gif);
+    lazy_gif.lazy_decode = 1;
+    lazy_gif.scaling = *scaling;
+    if (gif_load(&lazy_gif, filename) == ERROR_OUT) {
+        return ERROR_OUT;
+    }
+    if (lazy_gif.w != LED_COLS || lazy_gif.h != LED_ROWS || !lazy_gif.frames.length) {
+        printf("Error: GIF must be %dx%d with at least one frame\n", LED_COLS, LED_ROWS);
+        gif_free(&lazy_gif);
+        return ERROR_OUT;
+    }
+    file_bytes = lazy_gif.input.size;
+    canvas = (uint8_t *) malloc(lazy_gif.w * lazy_gif.h);
+
+    printf("%s: %lu frames, %.0f bytes\n", filename, (unsigned long) lazy_gif.frames.length, file_bytes);
+
+    /* Whole file, as the player loads it */
+    for (run = 0; run < runs; ++run) {
+        gif_init(&gif);
+        gif.scaling = *scaling;
+        start = time_now_ns();
+        if (gif_load(&gif, filename) == ERROR_OUT) {
+            return ERROR_OUT;
+        }
+        samples_add(&samples, time_now_ns() - start);
+        gif_free(&gif);
+    }
+    report(out, filename, "gif_load", &samples, file_bytes);
+
+    for (run = 0; run < runs; ++run) {
+        for (i = 0; i < lazy_gif.frames.length; ++i) {
+            frame = (struct frame *) dyn_arr_get(&lazy_gif.frames, i);
+            start = time_now_ns();
+            gif_decode_frame(&lazy_gif, frame, canvas);
+            samples_add(&samples, time_now_ns() - start);
+        }
+    }
+    report(out, filename, "gif_decode_frame", &samples, 0);
+
+    *hash = hash_frames(&lazy_gif, canvas);
+
+    /* Playback stages, on frames as the player keeps them */
+    gif_init(&gif);
+    gif.scaling = *scaling;
+    if (gif_load(&gif, filename) == ERROR_OUT) {
+        return ERROR_OUT;
+    }
+    frame_store_encode(&gif);
+
+    for (run = 0; run < runs; ++run) {
+        for (i = 0; i < gif.frames.length; ++i) {
+            ct_indices = frame_store_expand(&gif, i, canvas);
+            frame = (struct frame *) dyn_arr_get(&gif.frames, i);
+            start = time_now_ns();
+            if (!i) {
+                compose_first_frame(&color_frame, &gif, ct_indices, frame->rect.w, lut);
+            }
+            else {
+                compose_frame(&color_frame, &gif, frame, ct_indices, frame->rect.w, lut);
+            }
+            samples_add(&samples, time_now_ns() - start);
+        }
+    }
+    report(out, filename, "compose_frame", &samples, 0);
+
+    /* Packetizing depends on colors only, so one frame is enough */
+    for (run = 0; run < runs * 10; ++run) {
+        start = time_now_ns();
+        for (led = 0; led < CHUNK_LEDS; ++led) {
+            color_frame_to_eth(packets.packets[led], color_frame.adjusted, led);
+        }
+        samples_add(&samples, time_now_ns() - start);
+    }
+    report(out, filename, "color_frame_to_eth", &samples, 0);
+
+    for (kernel = PACKET_KERNEL_SCALAR; kernel <= PACKET_KERNEL_AVX2; ++kernel) {
+        if (!kernel_is_supported(kernel)) {
+            continue;
+        }
+        packet_kernel = kernel;
+        for (run = 0; run < runs * 10; ++run) {
+            start = time_now_ns();
+            packet_set_render(&packets, color_frame.adjusted);
+            samples_add(&samples, time_now_ns() - start);
+        }
+        snprintf(metric, sizeof(metric), "packet_set_render/%s", kernel_names[kernel]);
+        report(out, filename, metric, &samples, 0);
+    }
+    packet_kernel = PACKET_KERNEL_AUTO;
+
+    /* Expand, compose, packetize what changed and send every frame, to the
+       null sink, as the player does */
+    for (run = 0; run < runs; ++run) {
+        for (i = 0; i < gif.frames.length; ++i) {
+            start = time_now_ns();
+            frame = (struct frame *) dyn_arr_get(&gif.frames, i);
+            ct_indices = frame_store_expand(&gif, i, canvas);
+            compose_frame(&color_frame, &gif, frame, ct_indices, frame->rect.w, lut);
+            render_buffer_invalidate(&render, &color_frame.dirty);
+            color_frame.dirty.w = 0;
+            color_frame.dirty.h = 0;
+            set = render_buffer_render(&render, color_frame.adjusted);
+            render_buffer_publish(&render, set);
+            set = render_buffer_front(&render, &is_new);
+            tx_send(&tx, set, 0, CHUNK_LEDS);
+            samples_add(&samples, time_now_ns() - start);
+        }
+    }
+    report(out, filename, "refresh", &samples, 0);
+
+    free(samples.values);
+    free(canvas);
+    gif_free(&gif);
+    gif_free(&lazy_gif);
+
+    return SUCC_OUT;
+}
+
+void print_usage(const char *name) {
+    printf("Usage: %s [-n runs] [-o results.tsv] [-g golden | -w golden] [-f scale_mode[:filter]] <gif>...\n", name);
+    printf("       %s -k\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *out_filename = 0;
+    const char *golden_filename = 0;
+    uint8_t do_write_golden = 0;
+    uint8_t do_check_only = 0;
+    uint16_t runs = BENCH_RUNS;
+    struct scale_options scaling = {SCALE_NONE, SCALE_AREA};  /* Golden GIFs are floor sized */
+    double balance[COLOR_CHANNELS] = {1, 1, 1};
+    FILE *out = 0;
+    FILE *golden = 0;
+    uint64_t hash;
+    int status = SUCC_OUT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:o:g:w:f:k")) != -1) {
+        switch (opt) {
+            case 'n':
+                runs = atoi(optarg);
+                break;
+            case 'o':
+                /* Tab separated: file, metric, median us, p99 us, samples, MB/s,
+                   and a checksum row per file */
+                out_filename = optarg;
+                break;
+            case 'g':
+                golden_filename = optarg;
+                break;
+            case 'w':
+                /* Record checksums instead of checking them */
+                golden_filename = optarg;
+                do_write_golden = 1;
+                break;
+            case 'f':
+                /* Time loading GIFs of another size, as ddf -f fits them */
+                if (scale_parse(&scaling, optarg) == ERROR_OUT) {
+                    return ERROR_OUT;
+                }
+                break;
+            case 'k':
+                /* Only check the packet kernels and dirty rects, no GIFs needed */
+                do_check_only = 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return ERROR_OUT;
+        }
+    }
+
+    if ((optind >= argc && !do_check_only) || !runs) {
+        print_usage(argv[0]);
+        return ERROR_OUT;
+    }
+
+    color_table_init(&colors, MAX_BRIGHTNESS, 1, balance);
+    tx_open(&tx, TX_NULL, 0);
+    render_buffer_init(&render, tx.header);
+    packet_set_init(&packets, tx.header);
+
+    status = check_kernels(BENCH_KERNEL_FRAMES);
+    if (check_dirty_rects(BENCH_DIRTY_RECTS) == ERROR_OUT) {
+        status = ERROR_OUT;
+    }
+    if (do_check_only) {
+        tx_close(&tx);
+        return status;
+    }
+
+    if (out_filename && !(out = fopen(out_filename, "w"))) {
+        perror("Error [fopen results]");
+        return ERROR_OUT;
+    }
+    if (out) {
+        fprintf(out, "file\tmetric\tmedian_us\tp99_us\tsamples\tmb_per_s\tchecksum\n");
+    }
+    if (do_write_golden && !(golden = fopen(golden_filename, "w"))) {
+        perror("Error [fopen golden]");
+        return ERROR_OUT;
+    }
+
+    for (; optind < argc; ++optind) {
+        if (bench_file(argv[optind], runs, &scaling, out, &hash) == ERROR_OUT) {
+            status = ERROR_OUT;
+            continue;
+        }
+        printf("    checksum %016llx\n", (unsigned long long) hash);
+        if (out) {
+            fprintf(out, "%s\tchecksum\t\t\t\t\t%016llx\n", argv[optind], (unsigned long long) hash);
+        }
+
+        if (golden) {
+            fprintf(golden, "%s %016llx\n", argv[optind], (unsigned long long) hash);
+        }
+        else if (golden_filename && check_golden(golden_filename, argv[optind], hash) == ERROR_OUT) {
+            status = ERROR_OUT;
+        }
+    }
+
+    if (out) {
+        fclose(out);
+    }
+    if (golden) {
+        fclose(golden);
+    }
+    tx_close(&tx);
+
+    return status;
+}
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "global_defines.h"
+#include "gif.h"
+#include "packet.h"
+#include "color.h"
+#include "compose.h"
+#include "show.h"
+
+/* Show compiler: composites and packetizes every frame of a GIF ahead of
+   time, so the player can stream a show without decoding anything */
+
+#define PAYLOAD_BYTES (CHUNK_LEDS * DATA_BYTES)
+#define HASH_OFFSET 0xCBF29CE484222325ULL
+#define HASH_PRIME 0x100000001B3ULL
+
+struct color_table colors;
+struct color_frame color_frame;
+struct packet_set packets;
+
+uint64_t hash_payload(const uint8_t *payload) {
+    uint64_t hash = HASH_OFFSET;
+    size_t i;
+
+    for (i = 0; i < PAYLOAD_BYTES; ++i) {
+        hash = (hash ^ payload[i]) * HASH_PRIME;
+    }
+
+    return hash;
+}
+
+void print_show(struct show *show, const char *filename) {
+    printf(
+        "%s: %u frames, %u unique, brightness %.4f, gamma %.2f\n",
+        filename, show->header->frame_count, show->header->payload_count,
+        show->header->brightness, show->header->gamma
+    );
+}
+
+int write_padding(FILE *file, size_t bytes) {
+    static const uint8_t zeros[SHOW_ALIGN];
+
+    return fwrite(zeros, 1, bytes, file) == bytes ? SUCC_OUT : ERROR_OUT;
+}
+
+int compile_show(
+    const char *gif_filename,
+    const char *show_filename,
+    const struct color_lut *lut,
+    const struct scale_options *scaling,
+    struct show_header *header
+) {
+    struct gif gif;
+    struct frame *frame;
+    struct show_frame *frames;
+    uint8_t *payloads;  /* Unique payloads, PAYLOAD_BYTES each */
+    uint64_t *hashes;
+    static const uint8_t no_header[HEADER_BYTES];  /* Only payloads are stored */
+    uint8_t payload[PAYLOAD_BYTES];
+    size_t i, j;
+    uint8_t pass;
+    FILE *file;
+    size_t offset;
+    int status = ERROR_OUT;
+
+    gif_init(&gif);
+    gif.scaling = *scaling;
+    if (gif_load(&gif, gif_filename) == ERROR_OUT) {
+        return ERROR_OUT;
+    }
+    if (gif.w != LED_COLS || gif.h != LED_ROWS || !gif.frames.length) {
+        printf("Error: GIF must be %dx%d with at least one frame\n", LED_COLS, LED_ROWS);
+        gif_free(&gif);
+        return ERROR_OUT;
+    }
+
+    frames = (struct show_frame *) calloc(gif.frames.length, sizeof(struct show_frame));
+    payloads = (uint8_t *) malloc(gif.frames.length * PAYLOAD_BYTES);
+    hashes = (uint64_t *) malloc(gif.frames.length * sizeof(uint64_t));
+    packet_set_init(&packets, no_header);
+    header->payload_count = 0;
+
+    /* Shows loop, so frames are compiled as composited on the second pass,
+       on top of the last frame rather than the background */
+    for (pass = 0; pass < 2; ++pass) {
+        for (i = 0; i < gif.frames.length; ++i) {
+            frame = (struct frame *) dyn_arr_get(&gif.frames, i);
+            if (!pass && !i) {
+                compose_first_frame(&color_frame, &gif, frame->ct_indices, frame->rect.w, lut);
+            }
+            else {
+                compose_frame(&color_frame, &gif, frame, frame->ct_indices, frame->rect.w, lut);
+            }
+            if (!pass) {
+                continue;
+            }
+
+            packet_set_render(&packets, color_frame.adjusted);
+            for (j = 0; j < CHUNK_LEDS; ++j) {
+                memcpy(payload + j * DATA_BYTES, packets.packets[j] + HEADER_BYTES + LED_INDEX_BYTES, DATA_BYTES);
+            }
+
+            /* Frames that look the same share one payload */
+            hashes[header->payload_count] = hash_payload(payload);
+            for (j = 0; j < header->payload_count; ++j) {
+                if (hashes[j] == hashes[header->payload_count] &&
+                    !memcmp(payloads + j * PAYLOAD_BYTES, payload, PAYLOAD_BYTES)) {
+                    break;
+                }
+            }
+            if (j == header->payload_count) {
+                memcpy(payloads + j * PAYLOAD_BYTES, payload, PAYLOAD_BYTES);
+                ++header->payload_count;
+            }
+            frames[i].payload = j;
+            frames[i].delay = frame->delay;
+        }
+    }
+
+    memcpy(header->magic, SHOW_MAGIC, sizeof(header->magic));
+    header->version = SHOW_VERSION;
+    header->frame_count = gif.frames.length;
+    header->leds = CHUNK_LEDS;
+    header->payload_bytes = DATA_BYTES;
+    header->frames_offset = sizeof(struct show_header);
+    offset = header->frames_offset + gif.frames.length * sizeof(struct show_frame);
+    header->payloads_offset = (offset + SHOW_ALIGN - 1) / SHOW_ALIGN * SHOW_ALIGN;
+
+    if (!(file = fopen(show_filename, "wb"))) {
+        perror("Error [fopen]");
+    }
+    else {
+        if (fwrite(header, sizeof(struct show_header), 1, file) != 1 ||
+            fwrite(frames, sizeof(struct show_frame), gif.frames.length, file) != gif.frames.length ||
+            write_padding(file, header->payloads_offset - offset) == ERROR_OUT ||
+            fwrite(payloads, PAYLOAD_BYTES, header->payload_count, file) != header->payload_count) {
+            perror("Error [fwrite]");
+        }
+        else {
+            status = SUCC_OUT;
+        }
+        if (fclose(file) != 0) {
+            perror("Error [fclose]");
+            status = ERROR_OUT;
+        }
+    }
+
+    free(frames);
+    free(payloads);
+    free(hashes);
+    gif_free(&gif);
+
+    return status;
+}
+
+void print_usage(const char *name) {
+    printf(
+        "Usage: %s [-l level] [-G gamma] [-w r,g,b] [-f none|fit|fill|crop|stretch[:filter]] <gif> <show>\n"
+        "       %s -c <show>\n",
+        name, name
+    );
+}
+
+int main(int argc, char **argv) {
+    struct show_header header;
+    struct show show;
+    int level = COLOR_LEVELS - 1;
+    double gamma = 1;
+    double balance[COLOR_CHANNELS] = {1, 1, 1};  /* G, R, B */
+    double balance_r, balance_g, balance_b;
+    struct scale_options scaling = {SCALE_FIT, SCALE_AREA};
+    uint8_t do_check = 0;
+    int opt;
+
+    memset(&header, 0, sizeof(header));
+
+    while ((opt = getopt(argc, argv, "cl:G:w:f:")) != -1) {
+        switch (opt) {
+            case 'c':
+                /* Only validate an existing show */
+                do_check = 1;
+                break;
+            case 'l':
+                /* Brightness level, as sent over serial */
+                level = atoi(optarg);
+                if (level < 0 || level >= COLOR_LEVELS) {
+                    printf("Error: Brightness level must be 0 to %d\n", COLOR_LEVELS - 1);
+                    return ERROR_OUT;
+                }
+                break;
+            case 'G':
+                gamma = atof(optarg);
+                if (gamma <= 0) {
+                    printf("Error: Gamma must be positive\n");
+                    return ERROR_OUT;
+                }
+                break;
+            case 'w':
+                if (sscanf(optarg, "%lf,%lf,%lf", &balance_r, &balance_g, &balance_b) != 3) {
+                    printf("Error: White balance must be given as R,G,B\n");
+                    return ERROR_OUT;
+                }
+                balance[0] = balance_g;
+                balance[1] = balance_r;
+                balance[2] = balance_b;
+                break;
+            case 'f':
+                /* Fitting GIFs of another size to the floor, as in ddf */
+                if (scale_parse(&scaling, optarg) == ERROR_OUT) {
+                    return ERROR_OUT;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                return ERROR_OUT;
+        }
+    }
+
+    if (argc - optind != (do_check ? 1 : 2)) {
+        print_usage(argv[0]);
+        return ERROR_OUT;
+    }
+
+    if (!do_check) {
+        color_table_init(&colors, MAX_BRIGHTNESS, gamma, balance);
+        header.brightness = level / 255.0 * MAX_BRIGHTNESS;
+        header.gamma = gamma;
+        if (compile_show(argv[optind], argv[optind + 1], &colors.luts[level], &scaling, &header) == ERROR_OUT) {
+            return ERROR_OUT;
+        }
+        ++optind;
+    }
+
+    /* Read back what was written, so a bad show never reaches the floor */
+    if (show_open(&show, argv[optind]) == ERROR_OUT) {
+        return ERROR_OUT;
+    }
+    print_show(&show, argv[optind]);
+    show_close(&show);
+
+    return SUCC_OUT;
+}
@@ -0,0 +1,644 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "global_defines.h"
+#include "packet.h"
+#include "file_map.h"
+#include "timing.h"
+#include "tx.h"
+
+/* Stands in for the FPGA: receives packets from any ddf transmit mode,
+   rebuilds the floor from them and reports rates, loss and gaps. Missing
+   counts assume full refreshes, in delta mode (-d) they are expected.
+   Exits with an error if any packets were invalid, or missing outside
+   delta mode */
+
+#define RX_BATCH 64  /* Packets per recvmmsg */
+#define RX_PACKET_BYTES 2048  /* Anything on the link fits, FRAME_BYTES are used */
+#define RX_CONTROL_BYTES 64  /* Room for one SCM_TIMESTAMPNS */
+#define RX_REPORT_NS 1000000000ULL
+#define RX_IDLE_MS 1000  /* Report pending counts after this long without packets */
+#define RX_SOCKET_BUFFER (8 << 20)
+#define RX_PCAP_MAGIC_NS 0xA1B23C4D
+#define RX_PCAP_HEADER_BYTES 24
+
+/* Packet source, the receiving end of a transmit mode */
+struct rx {
+    enum tx_mode mode;
+    int fd;
+    const char *path;  /* TX_UNIX socket to remove on close */
+
+    /* TX_PCAP, read in place */
+    struct file_map pcap;
+    size_t offset;
+    uint32_t ts_scale;  /* Record timestamp fraction to ns */
+
+    struct mmsghdr msgs[RX_BATCH];
+    struct iovec iovs[RX_BATCH];
+    struct sockaddr_ll addresses[RX_BATCH];
+    uint8_t controls[RX_BATCH][RX_CONTROL_BYTES];
+    uint8_t buffers[RX_BATCH][RX_PACKET_BYTES];
+
+    /* Last batch received */
+    const uint8_t *packets[RX_BATCH];
+    uint32_t lengths[RX_BATCH];
+    uint64_t times[RX_BATCH];  /* CLOCK_REALTIME or capture time, unit: ns */
+};
+
+struct floor_counts {
+    uint64_t packets;
+    uint64_t refreshes;
+    uint64_t missing;  /* LED indices not seen in a refresh */
+    uint64_t duplicates;  /* LED indices seen twice in a refresh */
+    uint64_t invalid;  /* Too short, or LED index out of range */
+    uint64_t dropped;  /* By our own socket, so not the sender's or the link's */
+};
+
+/* Floor rebuilt from packets, and what was seen of the stream */
+struct floor {
+    uint8_t colors[LED_ROWS][LED_COLS][LED_CHANNELS];
+    uint8_t dumped[LED_ROWS][LED_COLS][LED_CHANNELS];
+    uint8_t seen[CHUNK_LEDS];
+    uint16_t seen_count;
+    int32_t last_index;  /* -1 before the first packet */
+    uint8_t is_synced;  /* Whether the current refresh was seen from its start */
+
+    uint64_t last_packet;
+    uint64_t refresh_start;
+    uint64_t report_start;
+
+    struct floor_counts counts;  /* Since the last report */
+    struct floor_counts totals;
+    struct interval_stats gaps;
+    struct interval_stats refreshes;
+
+    /* PPM dumps of changed refreshes */
+    const char *prefix;
+    double gain;
+    uint32_t dumps;
+};
+
+static volatile sig_atomic_t is_stopped = 0;
+
+void stop_handler(int signal) {
+    (void) signal;
+    is_stopped = 1;
+}
+
+uint64_t time_real_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int rx_open_pcap(struct rx *rx, const char *path) {
+    const uint32_t *header;
+
+    if (file_map_open(&rx->pcap, path) == ERROR_OUT) {
+        return ERROR_OUT;
+    }
+    header = (const uint32_t *) rx->pcap.data;
+    if (rx->pcap.size < RX_PCAP_HEADER_BYTES ||
+        (header[0] != TX_PCAP_MAGIC && header[0] != RX_PCAP_MAGIC_NS) ||
+        header[5] != TX_PCAP_LINKTYPE_ETHERNET) {
+        printf("Error: %s is not a native byte order Ethernet pcap file\n", path);
+        return ERROR_OUT;
+    }
+    rx->ts_scale = header[0] == TX_PCAP_MAGIC ? 1000 : 1;
+    rx->offset = RX_PCAP_HEADER_BYTES;
+
+    return SUCC_OUT;
+}
+
+int rx_open_raw(struct rx *rx, const char *interface_name) {
+    /* Everything arriving on interface, filtered per packet */
+
+    struct sockaddr_ll address;
+    struct ifreq interface_id;
+    int enable = 1;
+
+    if ((rx->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+        perror("Error [socket]");
+        return ERROR_OUT;
+    }
+
+    memset(&interface_id, 0, sizeof(struct ifreq));
+    strncpy(interface_id.ifr_name, interface_name, IFNAMSIZ - 1);
+    if (ioctl(rx->fd, SIOCGIFINDEX, &interface_id) < 0) {
+        perror("Error [SIOCGIFINDEX]");
+        return ERROR_OUT;
+    }
+
+    /* On a shared interface, copies of our own sends would fill the queue */
+    #ifdef PACKET_IGNORE_OUTGOING
+        if (setsockopt(rx->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &enable, sizeof(enable)) < 0) {
+            perror("Error [PACKET_IGNORE_OUTGOING]");
+        }
+    #endif
+
+    memset(&address, 0, sizeof(address));
+    address.sll_family = AF_PACKET;
+    address.sll_protocol = htons(ETH_P_ALL);
+    address.sll_ifindex = interface_id.ifr_ifindex;
+    if (bind(rx->fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        perror("Error [bind]");
+        return ERROR_OUT;
+    }
+
+    return SUCC_OUT;
+}
+
+int rx_open_datagram(struct rx *rx, const char *target) {
+    /* Bind where a TX_UDP or TX_UNIX sink with the same target sends to */
+
+    struct sockaddr_un address;
+    struct addrinfo hints;
+    struct addrinfo *result;
+    char host[256];
+    const char *port;
+    int status;
+
+    if (rx->mode == TX_UNIX) {
+        if (strlen(target) >= sizeof(address.sun_path)) {
+            printf("Error: Socket path too long\n");
+            return ERROR_OUT;
+        }
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, target);
+
+        if ((rx->fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+            perror("Error [socket]");
+            return ERROR_OUT;
+        }
+        unlink(target);
+        if (bind(rx->fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+            perror("Error [bind]");
+            return ERROR_OUT;
+        }
+        rx->path = target;
+        return SUCC_OUT;
+    }
+
+    if (!(port = strrchr(target, ':')) || (size_t) (port - target) >= sizeof(host)) {
+        printf("Error: UDP target must be given as host:port\n");
+        return ERROR_OUT;
+    }
+    memcpy(host, target, port - target);
+    host[port - target] = 0;
+    ++port;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((status = getaddrinfo(host[0] ? host : NULL, port, &hints, &result)) != 0) {
+        printf("Error: Could not resolve %s: %s\n", target, gai_strerror(status));
+        return ERROR_OUT;
+    }
+    if ((rx->fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol)) < 0) {
+        perror("Error [socket]");
+        freeaddrinfo(result);
+        return ERROR_OUT;
+    }
+    if (bind(rx->fd, result->ai_addr, result->ai_addrlen) < 0) {
+        perror("Error [bind]");
+        freeaddrinfo(result);
+        return ERROR_OUT;
+    }
+    freeaddrinfo(result);
+
+    return SUCC_OUT;
+}
+
+int rx_open(struct rx *rx, enum tx_mode mode, const char *target) {
+    /* target is the sink target, or the interface for sendto, mmsg and ring */
+
+    int size = RX_SOCKET_BUFFER;
+    int enable = 1;
+    uint16_t i;
+
+    rx->mode = mode;
+    rx->fd = -1;
+    rx->path = 0;
+
+    if (mode == TX_NULL) {
+        printf("Error: Nothing to receive from the null sink\n");
+        return ERROR_OUT;
+    }
+    if (mode == TX_PCAP) {
+        return rx_open_pcap(rx, target);
+    }
+
+    if ((mode == TX_UDP || mode == TX_UNIX ? rx_open_datagram(rx, target) : rx_open_raw(rx, target)) == ERROR_OUT) {
+        return ERROR_OUT;
+    }
+
+    /* Losses should be the sender's, not from a full receive queue. The
+       size is capped at net.core.rmem_max */
+    if (setsockopt(rx->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+        perror("Error [SO_RCVBUF]");
+    }
+    /* Kernel receive times, so batching does not hide the gaps */
+    if (setsockopt(rx->fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) < 0) {
+        perror("Error [SO_TIMESTAMPNS]");
+    }
+
+    memset(rx->msgs, 0, sizeof(rx->msgs));
+    for (i = 0; i < RX_BATCH; ++i) {
+        rx->iovs[i].iov_base = rx->buffers[i];
+        rx->iovs[i].iov_len = RX_PACKET_BYTES;
+        rx->msgs[i].msg_hdr.msg_iov = &rx->iovs[i];
+        rx->msgs[i].msg_hdr.msg_iovlen = 1;
+        if (mode != TX_UDP && mode != TX_UNIX) {
+            rx->msgs[i].msg_hdr.msg_name = &rx->addresses[i];
+        }
+    }
+
+    return SUCC_OUT;
+}
+
+int rx_receive_pcap(struct rx *rx) {
+    /* Up to a batch of records, 0 at the end of the file */
+
+    struct tx_pcap_record record;
+    int count = 0;
+
+    while (count < RX_BATCH && rx->offset + sizeof(record) <= rx->pcap.size) {
+        memcpy(&record, rx->pcap.data + rx->offset, sizeof(record));
+        rx->offset += sizeof(record);
+        if (record.incl_len > rx->pcap.size - rx->offset) {
+            printf("Error: Truncated pcap record\n");
+            rx->offset = rx->pcap.size;
+            break;
+        }
+        rx->packets[count] = rx->pcap.data + rx->offset;
+        rx->lengths[count] = record.incl_len;
+        rx->times[count] = record.ts_sec * 1000000000ULL + (uint64_t) record.ts_usec * rx->ts_scale;
+        rx->offset += record.incl_len;
+        ++count;
+    }
+
+    return count;
+}
+
+int rx_receive(struct rx *rx) {
+    /* Wait for the next batch of packets. Returns the count, 0 if none came
+       within RX_IDLE_MS, or ERROR_OUT at the end of the input */
+
+    struct pollfd poll_fd = {rx->fd, POLLIN, 0};
+    struct cmsghdr *cmsg;
+    struct timespec ts;
+    uint64_t now;
+    int count;
+    int i;
+
+    if (rx->mode == TX_PCAP) {
+        return (count = rx_receive_pcap(rx)) ? count : ERROR_OUT;
+    }
+
+    if ((count = poll(&poll_fd, 1, RX_IDLE_MS)) <= 0) {
+        return count < 0 && errno != EINTR ? ERROR_OUT : 0;
+    }
+
+    for (i = 0; i < RX_BATCH; ++i) {
+        rx->msgs[i].msg_hdr.msg_namelen = rx->msgs[i].msg_hdr.msg_name ? sizeof(struct sockaddr_ll) : 0;
+        rx->msgs[i].msg_hdr.msg_control = rx->controls[i];
+        rx->msgs[i].msg_hdr.msg_controllen = RX_CONTROL_BYTES;
+    }
+    if ((count = recvmmsg(rx->fd, rx->msgs, RX_BATCH, MSG_DONTWAIT, NULL)) < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+        perror("Error [recvmmsg]");
+        return ERROR_OUT;
+    }
+    now = time_real_ns();
+
+    for (i = 0; i < count; ++i) {
+        rx->packets[i] = rx->buffers[i];
+        rx->lengths[i] = rx->msgs[i].msg_len;
+        rx->times[i] = now;
+        for (cmsg = CMSG_FIRSTHDR(&rx->msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&rx->msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                rx->times[i] = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+            }
+        }
+
+        /* Our own sends, where the kernel could not leave them out */
+        if (rx->msgs[i].msg_hdr.msg_name && rx->addresses[i].sll_pkttype == PACKET_OUTGOING) {
+            rx->lengths[i] = 0;
+        }
+    }
+
+    return count;
+}
+
+uint32_t rx_dropped(struct rx *rx) {
+    /* Packets the kernel dropped for a full receive queue since the last
+       call. Only raw sockets keep count */
+
+    struct tpacket_stats packet_stats;
+    socklen_t length = sizeof(packet_stats);
+
+    if (rx->mode == TX_PCAP || rx->mode == TX_UDP || rx->mode == TX_UNIX ||
+        getsockopt(rx->fd, SOL_PACKET, PACKET_STATISTICS, &packet_stats, &length) < 0) {
+        return 0;
+    }
+
+    return packet_stats.tp_drops;
+}
+
+void rx_close(struct rx *rx) {
+    if (rx->mode == TX_PCAP) {
+        file_map_close(&rx->pcap);
+        return;
+    }
+    if (rx->fd >= 0) {
+        close(rx->fd);
+    }
+    if (rx->path) {
+        unlink(rx->path);
+    }
+}
+
+uint8_t is_floor_packet(const uint8_t *packet) {
+    /* Addressed to the FPGA, see tx_set_header */
+
+    static const uint8_t fpga_mac[ETH_ALEN] = {0x02, 0, 0, 0, 0, 0};
+
+    return !memcmp(packet, fpga_mac, ETH_ALEN);
+}
+
+void floor_init(struct floor *floor, const char *prefix, double gain) {
+    memset(floor, 0, sizeof(struct floor));
+    floor->last_index = -1;
+    floor->prefix = prefix;
+    floor->gain = gain;
+    interval_stats_reset(&floor->gaps);
+    interval_stats_reset(&floor->refreshes);
+}
+
+int floor_dump(struct floor *floor) {
+    /* Write colors as a binary PPM, scaled by gain, if they changed since
+       the last dump */
+
+    FILE *file;
+    char filename[4096];
+    uint8_t rgb[LED_COLS][3];
+    uint8_t row, col;
+    double value;
+
+    if (!memcmp(floor->colors, floor->dumped, sizeof(floor->colors))) {
+        return SUCC_OUT;
+    }
+    memcpy(floor->dumped, floor->colors, sizeof(floor->colors));
+
+    snprintf(filename, sizeof(filename), "%s%06u.ppm", floor->prefix, floor->dumps++);
+    if (!(file = fopen(filename, "wb"))) {
+        perror("Error [fopen ppm]");
+        return ERROR_OUT;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", LED_COLS, LED_ROWS);
+    for (row = 0; row < LED_ROWS; ++row) {
+        for (col = 0; col < LED_COLS; ++col) {
+            /* GRB to RGB */
+            value = floor->colors[row][col][1] * floor->gain;
+            rgb[col][0] = value > 255 ? 255 : lround(value);
+            value = floor->colors[row][col][0] * floor->gain;
+            rgb[col][1] = value > 255 ? 255 : lround(value);
+            value = floor->colors[row][col][2] * floor->gain;
+            rgb[col][2] = value > 255 ? 255 : lround(value);
+        }
+        fwrite(rgb, sizeof(rgb), 1, file);
+    }
+    fclose(file);
+
+    return SUCC_OUT;
+}
+
+void floor_end_refresh(struct floor *floor) {
+    /* A refresh only counts if it was seen from its first packet */
+
+    if (floor->is_synced) {
+        ++floor->counts.refreshes;
+        floor->counts.missing += CHUNK_LEDS - floor->seen_count;
+        if (floor->prefix) {
+            floor_dump(floor);
+        }
+    }
+    floor->is_synced = 1;
+    memset(floor->seen, 0, sizeof(floor->seen));
+    floor->seen_count = 0;
+}
+
+void floor_add(struct floor *floor, const uint8_t *packet, uint32_t length, uint64_t time) {
+    /* Packets go out in ascending LED index order, so an index below the
+       last one starts a new refresh. Reordering shows up as extra refreshes */
+
+    uint16_t led_index;
+
+    ++floor->counts.packets;
+    if (floor->last_packet) {
+        interval_stats_add(&floor->gaps, time - floor->last_packet);
+    }
+    floor->last_packet = time;
+
+    if (length < FRAME_BYTES || (led_index = eth_to_color_frame(floor->colors, packet)) >= CHUNK_LEDS) {
+        ++floor->counts.invalid;
+        return;
+    }
+
+    if (floor->last_index < 0) {
+        floor->is_synced = !led_index;
+        floor->refresh_start = time;
+    }
+    else if (led_index < floor->last_index) {
+        floor_end_refresh(floor);
+        interval_stats_add(&floor->refreshes, time - floor->refresh_start);
+        floor->refresh_start = time;
+    }
+    floor->last_index = led_index;
+
+    if (floor->seen[led_index]) {
+        ++floor->counts.duplicates;
+        return;
+    }
+    floor->seen[led_index] = 1;
+    ++floor->seen_count;
+}
+
+void floor_print(struct floor *floor, double seconds) {
+    struct floor_counts *counts = &floor->counts;
+    double mean;
+    double jitter;
+
+    printf(
+        "Packets: %.0f/s (%.2f Mbit/s), refreshes: %.1f/s, missing %llu, duplicate %llu, invalid %llu, dropped %llu",
+        counts->packets / seconds, counts->packets * FRAME_BYTES * 8 / seconds / 1e6,
+        counts->refreshes / seconds, (unsigned long long) counts->missing,
+        (unsigned long long) counts->duplicates, (unsigned long long) counts->invalid,
+        (unsigned long long) counts->dropped
+    );
+    if (floor->gaps.count) {
+        mean = floor->gaps.sum / floor->gaps.count;
+        jitter = sqrt(fmax(floor->gaps.sum_sq / floor->gaps.count - mean * mean, 0));
+        printf(
+            ". Gap: %.2f us (jitter %.2f, min %.2f, max %.2f)",
+            mean / 1000, jitter / 1000, floor->gaps.min / 1000.0, floor->gaps.max / 1000.0
+        );
+    }
+    if (floor->refreshes.count) {
+        mean = floor->refreshes.sum / floor->refreshes.count;
+        printf(". Refresh: %.1f Hz (max %.2f ms)", 1e9 / mean, floor->refreshes.max / 1e6);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+void floor_report(struct floor *floor, struct rx *rx, uint64_t now) {
+    /* Print rates over the time since the last report, then add the counts
+       to the totals */
+
+    struct floor_counts *counts = &floor->counts;
+    double seconds = (now - floor->report_start) / 1e9;
+
+    counts->dropped = rx_dropped(rx);
+
+    if (counts->packets || counts->dropped) {
+        floor_print(floor, seconds > 0 ? seconds : 1);
+    }
+    floor->totals.packets += counts->packets;
+    floor->totals.refreshes += counts->refreshes;
+    floor->totals.missing += counts->missing;
+    floor->totals.duplicates += counts->duplicates;
+    floor->totals.invalid += counts->invalid;
+    floor->totals.dropped += counts->dropped;
+    memset(counts, 0, sizeof(struct floor_counts));
+    interval_stats_reset(&floor->gaps);
+    interval_stats_reset(&floor->refreshes);
+    floor->report_start = now;
+}
+
+void print_usage(const char *name) {
+    printf(
+        "Usage: %s [-t sendto|mmsg|ring|pcap:file|udp:host:port|unix:path] [-i interface] "
+        "[-n refreshes] [-p ppm_prefix] [-g gain] [-d]\n",
+        name
+    );
+}
+
+int main(int argc, char **argv) {
+    enum tx_mode mode = TX_SENDTO;
+    const char *target = 0;
+    const char *interface_name = "enp2s0";
+    const char *prefix = 0;
+    double gain = 1;  /* PPM scale, ddf sends at MAX_BRIGHTNESS */
+    uint64_t max_refreshes = 0;  /* 0 to run until interrupted */
+    uint8_t is_delta = 0;
+    static struct rx rx;
+    static struct floor floor;
+    struct sigaction action;
+    int count;
+    int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:i:n:p:g:d")) != -1) {
+        switch (opt) {
+            case 't':
+                /* As given to ddf, raw modes all receive the same way */
+                if (tx_parse_mode(&mode, &target, optarg) == ERROR_OUT) {
+                    return ERROR_OUT;
+                }
+                break;
+            case 'i':
+                interface_name = optarg;
+                break;
+            case 'n':
+                max_refreshes = strtoull(optarg, 0, 10);
+                break;
+            case 'p':
+                /* Each refresh that changed the floor, as <prefix>NNNNNN.ppm */
+                prefix = optarg;
+                break;
+            case 'g':
+                gain = atof(optarg);
+                break;
+            case 'd':
+                /* Sender runs ddf -d, refreshes only carry what changed */
+                is_delta = 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return ERROR_OUT;
+        }
+    }
+
+    if (rx_open(&rx, mode, target ? target : interface_name) == ERROR_OUT) {
+        rx_close(&rx);
+        return ERROR_OUT;
+    }
+    floor_init(&floor, prefix, gain);
+
+    /* Interrupt the wait rather than restart it, to print the totals */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_handler;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    while (!is_stopped && (!max_refreshes || floor.totals.refreshes + floor.counts.refreshes < max_refreshes)) {
+        if ((count = rx_receive(&rx)) == ERROR_OUT) {
+            break;
+        }
+        if (!count) {
+            if (floor.counts.packets) {
+                floor_report(&floor, &rx, floor.last_packet);
+            }
+            continue;
+        }
+
+        for (i = 0; i < count; ++i) {
+            if (rx.lengths[i] < HEADER_BYTES || !is_floor_packet(rx.packets[i])) {
+                continue;
+            }
+            if (!floor.report_start) {
+                floor.report_start = rx.times[i];
+            }
+            else if (rx.times[i] - floor.report_start >= RX_REPORT_NS) {
+                floor_report(&floor, &rx, rx.times[i]);
+            }
+            floor_add(&floor, rx.packets[i], rx.lengths[i], rx.times[i]);
+        }
+    }
+
+    /* The last refresh counts if it is complete */
+    if (floor.seen_count == CHUNK_LEDS) {
+        floor_end_refresh(&floor);
+    }
+    floor_report(&floor, &rx, floor.last_packet);
+    printf(
+        "Total: %llu packets, %llu refreshes, %llu missing, %llu duplicate, %llu invalid, %llu dropped\n",
+        (unsigned long long) floor.totals.packets, (unsigned long long) floor.totals.refreshes,
+        (unsigned long long) floor.totals.missing, (unsigned long long) floor.totals.duplicates,
+        (unsigned long long) floor.totals.invalid, (unsigned long long) floor.totals.dropped
+    );
+    rx_close(&rx);
+
+    return (floor.totals.missing && !is_delta) || floor.totals.invalid ? ERROR_OUT : SUCC_OUT;
+}
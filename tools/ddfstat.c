@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "global_defines.h"
+#include "stats.h"
+#include "timing.h"
+
+/* Reads the stats segment of a running (or crashed) ddf: latency
+   percentiles per stage and error counters, totals or per interval */
+
+int stats_map(const char *path, const struct stats **segment) {
+    int fd;
+    void *data;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        perror("Error [open stats]");
+        return ERROR_OUT;
+    }
+    data = mmap(0, sizeof(struct stats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Error [mmap stats]");
+        return ERROR_OUT;
+    }
+    *segment = (const struct stats *) data;
+
+    if (memcmp((*segment)->magic, STATS_MAGIC, sizeof((*segment)->magic)) ||
+        (*segment)->version != STATS_VERSION) {
+        printf("Error: %s is not a ddf stats segment\n", path);
+        munmap(data, sizeof(struct stats));
+        return ERROR_OUT;
+    }
+
+    return SUCC_OUT;
+}
+
+void stats_diff(struct stats *diff, const struct stats *now, const struct stats *then) {
+    /* Values recorded between two snapshots. Maxima are not kept per
+       interval, they come from the histograms instead */
+
+    uint8_t i;
+    uint16_t j;
+
+    *diff = *now;
+    for (i = 0; i < STATS_STAGES; ++i) {
+        diff->histograms[i].count -= then->histograms[i].count;
+        diff->histograms[i].sum -= then->histograms[i].sum;
+        diff->histograms[i].max = 0;
+        for (j = 0; j < STATS_BUCKETS; ++j) {
+            diff->histograms[i].buckets[j] -= then->histograms[i].buckets[j];
+        }
+    }
+    for (i = 0; i < STATS_COUNTERS; ++i) {
+        diff->counters[i] -= then->counters[i];
+    }
+}
+
+void print_stats(const struct stats *snapshot) {
+    const struct stats_histogram *histogram;
+    uint8_t i;
+
+    printf("%-10s %10s %10s %10s %10s %10s %10s\n", "stage", "count", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+    for (i = 0; i < STATS_STAGES; ++i) {
+        histogram = &snapshot->histograms[i];
+        printf(
+            "%-10s %10llu %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+            stats_stage_names[i],
+            (unsigned long long) histogram->count,
+            histogram->count ? histogram->sum / 1000.0 / histogram->count : 0,
+            stats_percentile(histogram, 0.5) / 1000.0,
+            stats_percentile(histogram, 0.9) / 1000.0,
+            stats_percentile(histogram, 0.99) / 1000.0,
+            (histogram->max ? histogram->max : stats_percentile(histogram, 1)) / 1000.0
+        );
+    }
+    for (i = 0; i < STATS_COUNTERS; ++i) {
+        printf("%s%s %llu", i ? ", " : "", stats_counter_names[i], (unsigned long long) snapshot->counters[i]);
+    }
+    printf("\n");
+}
+
+void print_usage(const char *name) {
+    printf("Usage: %s [-f stats_path] [-i interval_s]\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *path = STATS_PATH;
+    double interval = 0;  /* Unit: s, 0 to print totals once */
+    const struct stats *segment;
+    static struct stats then, now, diff;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:i:")) != -1) {
+        switch (opt) {
+            case 'f':
+                path = optarg;
+                break;
+            case 'i':
+                interval = atof(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                return ERROR_OUT;
+        }
+    }
+
+    if (stats_map(path, &segment) == ERROR_OUT) {
+        return ERROR_OUT;
+    }
+
+    printf(
+        "ddf pid %d%s, up %.1f s\n",
+        segment->pid,
+        kill(segment->pid, 0) < 0 && errno == ESRCH ? " (not running)" : "",
+        (time_now_ns() - segment->started) / 1e9
+    );
+
+    if (interval <= 0) {
+        now = *segment;
+        print_stats(&now);
+        return SUCC_OUT;
+    }
+
+    then = *segment;
+    while (1) {
+        time_wait_until(time_now_ns() + interval * 1e9, 0);
+        now = *segment;
+        stats_diff(&diff, &now, &then);
+        print_stats(&diff);
+        fflush(stdout);
+        then = now;
+    }
+}